@@ -1,6 +1,7 @@
 /*
  * powerscan: Measure a power spectrum from a SoapySDR receiver
  */
+#define		_GNU_SOURCE			// For CPU affinity and per-thread resource usage
 #include	<getopt.h>
 #include	<stdlib.h>
 #include	<stdio.h>
@@ -11,23 +12,49 @@
 #include	<complex.h>
 #include	<math.h>
 #include	<assert.h>
+#include	<ctype.h>
+#include	<errno.h>
 #include	<signal.h>
+#include	<time.h>
+#include	<pthread.h>
 
 #include	<SoapySDR/Device.h>
 #include	<SoapySDR/Formats.h>
+#include	<SoapySDR/Version.h>
 
 #include	<fftw3.h>
 
+// Vector kernels are built for x86 whatever the target, and chosen when the CPU has them.
+// NEON is part of every 64-bit ARM, so it is used whenever the build targets it.
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define	X86_KERNELS
+#include	<immintrin.h>
+#define	TARGET_AVX2	__attribute__((target("avx2")))
+#define	TARGET_AVX512	__attribute__((target("avx512f")))
+#endif
+#if defined(__ARM_NEON)
+#define	NEON_KERNELS
+#include	<arm_neon.h>
+#endif
+
 #ifdef _WIN32
 #include	<windows.h>
 #include	<fcntl.h>
 #include	<io.h>
+#include	<direct.h>			// For _mkdir()
 #include	"getopt/getopt.h"
 #define		usleep(x)	Sleep(x/1000)
 #define	_USE_MATH_DEFINES
 #else
 #include	<unistd.h>
 #include	<sys/time.h>			// For gettimeofday()
+#include	<sys/mman.h>			// For mmap() and mlock()
+#include	<sys/resource.h>		// For getrusage()
+#include	<sys/stat.h>
+#include	<sys/socket.h>			// For the daemon's Unix socket
+#include	<sys/un.h>
+#include	<fcntl.h>
+#include	<sched.h>
 #endif
 
 typedef	int_least64_t	Frequency;
@@ -37,12 +64,301 @@ typedef	int_least64_t	ClockTime;
 #define	MIN_DWELL_TIME	100000			// minimum time on each tuning, in microseconds
 #define	MAX_CROP_RATIO	0.6			// Cropping more than this just doesn't make sense
 #define	RETUNE_USLEEP	5000			// 5ms. Why is this not built-in to Soapy?
+#define	MAX_SETTLE_USEC	1000000			// If settling takes longer than this, the timestamps can't be trusted
+#define	COMMAND_LEAD_USEC 1000			// How far ahead to schedule a timed retune
 #define	MAX_SAMPLES 	(01<<FFT_MAX_BITS)	// Maximum number of I/Q sample pairs to receive in each buffer
+#define	RING_BLOCKS	16			// Default number of receive buffers in the sample ring
+#define	FFT_BATCH_SAMPLES 16384			// Unless told otherwise, gather at least this many samples into each FFT batch
+#define	MAX_FFT_BATCH	64			// Most FFT frames transformed together
+#define	MAX_OVERLAP	90			// Most percent of each FFT frame to share with the next
+#define	MAX_STREAM_CHANNELS 8			// Most channels received together in one stream
+#define	RING_POLL_USLEEP 200			// How long the DSP sleeps when the sample ring is empty
+#define	READ_TIMEOUT	1000000			// Timeout on each stream read, in microseconds
+#define	ARENA_ALIGN	64			// Cache line, and the widest SIMD vector
+#define	ARENA_ROUND(n)	(((size_t)(n) + ARENA_ALIGN-1) & ~(size_t)(ARENA_ALIGN-1))
+#define	HUGE_PAGE_SIZE	(2*1024*1024)
+#define	RECORD_CHUNK_BYTES (4*1024*1024)	// Size of each write to a recording
+#define	RECORD_CHUNKS	32			// Chunks queued for the writer, enough to ride out a disk stall
+#define	RECORD_ALIGN	4096			// Buffer alignment for O_DIRECT
+#define	RECORD_POLL_USLEEP 1000			// How long the writer sleeps when there's nothing to write
+#define	TRIGGER_PRE_MS	100			// Default history to keep from before a trigger
+#define	TRIGGER_POST_MS	100			// Default time to capture after a trigger
+#define	SYNTH_SAMPLE_RATE 10000000		// Default sample rate for synthesised signals
+#define	SYNTH_PERIOD_MS	10			// Burst repetition and chirp sweep period
+#define	SYNTH_SEARCH	16			// How many buckets either side to look for a synthesised signal
+
+/*
+ * One aligned allocation that owns every buffer used during a scan
+ */
+typedef struct
+{
+	char*		base;
+	size_t		size;
+	size_t		used;
+	size_t		mapped;			// Size of the mapping, if mmap'd rather than allocated
+	bool		huge_pages;		// Mapped from explicit huge pages
+	bool		locked;			// Locked into memory
+} Arena;
+
+/*
+ * A sample converter normalises a run of received I/Q pairs to complex float, applying the window function.
+ * The window has the sample scale folded in, and a value for each of I and Q, so the output is one multiply per value.
+ */
+typedef void	(*SampleConverter)(const void* iq, float* out, const float* window, int samples);
+
+typedef struct
+{
+	const char*	name;			// SoapySDR stream format
+	int		bytes;			// Bytes per I/Q sample pair
+	double		full_scale;		// Used if the device doesn't report one
+	SampleConverter	convert;
+	const char*	sigmf;			// SigMF core:datatype, if there is one
+} StreamFormat;
+
+/*
+ * Per-frame DSP kernels. A power kernel squares the magnitude of a run of FFT bins, an accumulation kernel adds a run of them to the scan.
+ * Power stays in single precision, without a square root, and is only converted to dB for output.
+ */
+typedef void	(*PowerKernel)(const fftwf_complex* bins, float* power, int count);
+typedef void	(*AccumulateKernel)(float* accumulation, const float* power, int count);
+
+/*
+ * A set of kernels written for one instruction set. Converters not given here use the plain one for the format.
+ */
+typedef struct
+{
+	const char*	name;			// As given to -k
+	bool		(*supported)(void);	// Does this CPU have the instructions? Always, if not given
+	SampleConverter	convert_cs8;
+	SampleConverter	convert_cu8;
+	SampleConverter	convert_cs16;
+	SampleConverter	convert_cf32;
+	PowerKernel	squared_magnitude;
+	AccumulateKernel accumulate;
+} KernelSet;
+
+/*
+ * A block of samples received from the device, as passed from the acquisition thread to the DSP.
+ */
+typedef struct
+{
+	void*		buffer;			// Our own storage for I/Q sample pairs
+	const void*	iq;			// The received I/Q sample pairs, in buffer or in a driver buffer
+	long		handle;			// Direct access buffer handle to release, or -1
+	int		samples;		// Number of sample pairs received, or a negative SoapySDR error
+	int		flags;			// Flags received in the buffer header
+	long long	buffer_time;		// Buffer timestamp in nanoseconds (if flags has SOAPY_SDR_HAS_TIME)
+	ClockTime	receive_time;		// clock_time() when the read completed
+	unsigned	epoch;			// Value of retune_epoch when the read started
+
+	/* Problems since the previous block was delivered */
+	int		overflows;		// Reads that returned SOAPY_SDR_OVERFLOW
+	int		timeouts;		// Reads that returned SOAPY_SDR_TIMEOUT
+	long		dropped;		// Samples thrown away because the ring was full
+	int		preemptions;		// Times the receive thread was preempted
+	int		preempted_drops;	// Overflows or drops that followed a preemption
+	bool		accounted;		// account_block() has seen this block
+} SampleBlock;
+
+/*
+ * A recording to replay instead of receiving from a device.
+ * The samples are memory-mapped and processed in place.
+ */
+typedef struct
+{
+	long		sample_start;		// First sample at this frequency
+	Frequency	frequency;		// Centre frequency
+	ClockTime	time;			// When the first sample was received, if known
+	long long	hardware_time;		// Device timestamp (ns) of the first sample, if known
+} Capture;
+
+typedef struct
+{
+	const char*	path;			// As given on the command line
+	const void*	data;			// Mapped sample data
+	size_t		length;			// Bytes mapped
+	long		samples;		// Number of I/Q sample pairs
+	Capture*	captures;		// Where the frequency changes, in sample order
+	int		capture_count;
+} Recording;
+
+/*
+ * Received samples being recorded to SigMF files.
+ * The DSP copies samples into chunks, and a writer thread writes each full chunk,
+ * so a slow disk costs recorded samples rather than received ones.
+ */
+typedef struct
+{
+	const char*	base;			// Path without the .sigmf-data or .sigmf-meta extension
+	int		fd;
+	bool		direct;			// Opened with O_DIRECT
+	char*		chunks;			// RECORD_CHUNKS buffers, aligned for O_DIRECT
+	size_t		fill;			// Bytes in the chunk being filled
+	unsigned	head;			// Chunks filled. Written only by the DSP
+	unsigned	tail;			// Chunks written. Written only by the writer thread
+	pthread_t	thread;
+	bool		running;
+	bool		stop;			// Asks the writer thread to finish
+	bool		failed;			// A write failed, so recording has stopped
+	bool		gap;			// Samples were dropped, so start a new capture
+	long		samples;		// Samples recorded
+	long		dropped;		// Samples not recorded because the writer was behind
+	unsigned	high_water;		// Greatest number of chunks ever waiting
+	long long	next_time;		// Expected timestamp (ns) of the next samples, or 0 if unknown
+	Capture*	captures;
+	int		capture_count;
+	int		capture_limit;		// Allocated size of captures
+} Recorder;
+
+/*
+ * Captures triggered by a strong signal. The history of the current tuning is kept in a circular buffer,
+ * so when handle_fft_out() sees a bin over the threshold, the samples from before it are still available.
+ * Once the post-trigger window has been received, the capture is copied out and written by a writer thread.
+ */
+typedef struct
+{
+	float		level;			// dBFS in one FFT bin that triggers a capture
+	float		power;			// The level as an FFT output power
+	int		pre_ms;			// History to keep from before the trigger
+	int		post_ms;		// Time to capture after the trigger
+	const char*	prefix;			// Captures are written to prefix-N.sigmf-data and .sigmf-meta
+
+	char*		history;		// Circular buffer of recent samples on this tuning
+	long		capacity;		// Samples the history can hold
+	long		total;			// Samples added to the history on this tuning
+	long		processed;		// Samples processed into FFT frames on this tuning
+	Frequency	frequency;		// Tuning the history is for
+
+	bool		pending;		// Triggered, waiting for the post-trigger window
+	long		start;			// First sample to capture
+	long		trigger_sample;		// End of the FFT frame that triggered
+	float		peak_level;		// dBFS of the strongest bin in that frame
+	Frequency	peak_frequency;
+	ClockTime	trigger_time;
+
+	char*		event;			// Copy of a capture being written
+	long		event_samples;
+	long		event_trigger;		// Sample in the capture where the trigger frame starts
+	Capture		event_capture;
+	float		event_level;
+	Frequency	event_peak;
+	bool		event_ready;		// Handed to the writer thread
+	int		sequence;		// Number of captures so far
+	pthread_t	thread;
+	bool		running;
+	bool		stop;			// Asks the writer thread to finish
+	long		missed;			// Triggers dropped because the writer was still busy
+} Trigger;
+
+/*
+ * Signals synthesised instead of receiving from a device.
+ * Their frequencies are absolute, so what is generated depends on the current tuning.
+ */
+typedef enum
+{
+	SIGNAL_TONE,				// A continuous carrier
+	SIGNAL_CHIRP,				// Sweeps across span every SYNTH_PERIOD_MS
+	SIGNAL_BURST,				// A carrier that is on for duty of every SYNTH_PERIOD_MS
+	SIGNAL_NOISE				// Gaussian noise across the whole band
+} SignalKind;
+
+typedef struct
+{
+	SignalKind	kind;
+	Frequency	frequency;		// Centre frequency
+	Frequency	span;			// Chirp sweep width
+	float		duty;			// Fraction of the time a burst is on
+	float		level;			// Power in dB relative to full scale
+	fftwf_complex	phasor;			// Phase of the carrier at the next sample
+} Signal;
+
+typedef struct
+{
+	Signal*		signals;
+	int		signal_count;
+	fftwf_complex*	buffer;			// MAX_SAMPLES of generated samples
+	float		noise_amplitude;	// Scale of the noise, if any
+	uint64_t	random;			// State of the noise generator
+	long		sample;			// Samples generated on this tuning
+} Synthesiser;
+
+/*
+ * Problems in the receive path, counted per tuning and per scan
+ */
+typedef struct
+{
+	long		overflows;		// Driver reported SOAPY_SDR_OVERFLOW
+	long		timeouts;		// Reads that returned no samples in time
+	long		errors;			// Other stream errors
+	long		lost_samples;		// Missing according to buffer timestamps, not counting dropped ones
+	long		dropped_samples;	// Thrown away because the sample ring was full
+	long		discarded_frames;	// FFT frames excluded from accumulation because of the above
+	long		preemptions;		// Involuntary context switches on the receive thread
+	long		preempted_drops;	// Overflows or drops that followed a preemption
+} StreamStats;
+
+/*
+ * Lock-free single-producer/single-consumer ring of preallocated sample blocks.
+ * The acquisition thread only advances head, the DSP only advances tail.
+ */
+typedef struct
+{
+	SampleBlock*	blocks;
+	int		size;			// Number of blocks (a power of two)
+	unsigned	head;			// Next block to fill. Written only by the producer
+	unsigned	tail;			// Next block to consume. Written only by the consumer
+	SampleBlock	overrun;		// Where the producer reads to when the ring is full
+	unsigned	limit;			// Maximum blocks waiting (fewer than size when holding driver buffers)
+	bool		held;			// Without a thread, blocks[0] hasn't been released yet
+
+	/* Problems to report with the next block delivered. Written only by the producer */
+	int		overflows;
+	int		timeouts;
+	long		dropped;
+	int		preemptions;
+	int		preempted_drops;
+
+	long		involuntary_switches;	// Receive thread preemptions so far
+	unsigned	high_water;		// Greatest number of blocks ever waiting
+	ClockTime	newest_time;		// Time of the end of the newest block in the ring
+	long		overruns;		// Blocks dropped because the ring was full
+	long		blocks_received;	// Blocks delivered into the ring
+} SampleRing;
 
+/*
+ * The time as seen by the samples. A device delivers samples in real time, but replayed or synthesised
+ * samples arrive as fast as they can be processed, so their time is counted from the samples at the nominal rate.
+ * Then the dwells, and everything timestamped, come out the same however fast the host is.
+ */
+typedef struct
+{
+	bool		counted;		// Time is counted from samples, not read from the system clock
+	ClockTime	base;			// Time of the first sample counted
+	long long	samples;		// Samples counted since then
+	double		sample_rate;		// Nominal sample rate
+} StreamClock;
+
+/*
+ * What a daemon client asked for, so a request for the same scan doesn't replan.
+ */
 typedef struct
+{
+	Frequency	start_frequency;
+	Frequency	end_frequency;
+	Frequency	frequency_resolution;	// As requested, not as planned
+	int		scan_time;
+} ScanRequest;
+
+typedef struct Receiver	Receiver;
+typedef struct ProgramConfiguration ProgramConfiguration;
+
+struct ProgramConfiguration
 {
 	const char*	sdr_name;		// The name of an SDR device known to SoapySDR
+	const char**	sdr_names;		// Every device given, to scan with in parallel
+	int		sdr_name_count;
 	int		sdr_channel;
+	int		stream_channels;	// Channels from sdr_channel up to stream together, taking alternate tunings
 //	const char*	antenna;		// Which antenna to use
 	int		gain;			// db of gain to use
 
@@ -55,41 +371,135 @@ typedef struct
 	int		scan_time;		// Number of seconds for one scan (default = 10)
 
 	float		crop_ratio;		// How much of each tuning range should we discard?
+	int		ring_blocks;		// Size of the sample ring (0 = read on the DSP thread)
+	bool		no_direct_access;	// Don't receive directly from the driver's buffers
+	int		settle_time;		// Microseconds to discard after each retune (-1 = device default)
+	bool		pipelined;		// Retune as soon as a dwell has been received, and process its tail while settling
+	bool		lock_memory;		// Lock the buffers into memory, using huge pages if possible
+	int		receive_cpu;		// CPU to pin the receive path to (-1 = any)
+	int		dsp_cpu;		// CPU to pin the FFT and accumulation to (-1 = any)
+	int		receive_priority;	// SCHED_FIFO priority for the receive path (0 = normal scheduling)
+	bool		burst_mode;		// Stream one burst per tuning, instead of continuously
 
 	FILE*		verbose;		// Where to send verbose output (NULL means don't)
+	const char*	replay_path;		// Replay this recording instead of using a device
+	const char*	synthesise_spec;	// Synthesise these signals instead of using a device
+	const char*	record_base;		// Record received samples to this SigMF recording
+	bool		triggered;		// Capture samples around any bin over the trigger level
+	bool		probe_again;		// Query the device's capabilities, even if they're cached
+	const char*	socket_path;		// Serve scan requests on this Unix socket, instead of scanning once
 
 	/* Calculated or discovered configuration settings */
 	SoapySDRDevice*	device;
+	char*		capability_cache;	// File the device's capabilities are cached in, if anywhere
+	bool		capabilities_cached;	// The capabilities came from the cache, not the device
+	SoapySDRKwargs	hardware_info;		// As reported by the device
+	SoapySDRKwargs	channel_info;		// For sdr_channel
 	size_t		channel_count;		// How many channels are available on this device?
 	double*		sample_rates;		// Available sample rates
 	size_t		num_sample_rates;
 	double		sample_rate;		// Selected sample rate
+	const char*	native_format;		// Format the device delivers without conversion
+	double		full_scale;		// Maximum sample magnitude in the native format
+	const StreamFormat* stream_format;	// Format we receive in
+	const char*	kernel_name;		// DSP kernels asked for, instead of the best the CPU has
+	const KernelSet* kernels;		// DSP kernels in use
+	SampleConverter	convert;		// The stream format's converter from those kernels
+	float		sample_scale;		// Multiplier to normalise samples to +/-1
+	size_t		direct_buffers;		// Number of driver buffers we can receive from in place (0 = use readStream)
+	bool		hardware_time;		// Device timestamps are usable to decide when a retune has settled
+	bool		timed_commands;		// Device accepts setCommandTime() for retunes
 
 	/* Runtime variables */
 	SoapySDRStream*	stream;
+	Arena		arena;			// Owns the sample ring and all FFT and accumulation buffers
+	Recording	recording;		// The recording being replayed, if any
+	Synthesiser	synthesiser;		// The signals being synthesised, if any
+	Recorder	recorder;		// Where received samples are being recorded, if anywhere
+	Trigger		trigger;		// Triggered captures
+	SampleRing	ring;			// Samples passed from the acquisition thread
+	StreamClock	stream_clock;		// Time for replayed or synthesised samples
+	pthread_t	acquisition_thread;
+	bool		acquisition_running;
+	bool		acquisition_stop;	// Asks the acquisition thread to finish
+	unsigned	retune_epoch;		// Incremented when samples before this point must be discarded
+	long long	change_time;		// Device time (ns) of the last config change, if hardware_time
+	long long	settled_time;		// Device time (ns) when the last config change has settled
+	long		settle_discarded;	// Samples discarded while the last retune settled
+	long		queue_samples;		// Samples the driver can hold, perhaps captured before a retune
+	pthread_mutex_t* device_lock;		// Shared by every channel streamed from the device, or 0 if this has it to itself
+	long		tail_samples;		// Samples processed for the previous tuning after its retune was issued
+	long		burst_remaining;	// Samples still to come in this burst
+	long long	next_sample_time;	// Expected timestamp (ns) of the next block, or 0 if unknown
+	StreamStats	tuning_stats;		// Receive problems on the current tuning
+	StreamStats	scan_stats;		// Receive problems during the current scan
 
 	int		tuning_count;		// Number of times we have to retune for one scan
 	int		dwell_time;		// Number of microseconds for each tuning
 	Frequency	tuning_start;		// Initial centre frequency to tune
 	Frequency	tuning_bandwidth;	// Bandwidth to digitise
+	Frequency	tuning_step;		// Distance between this receiver's tunings
 	Frequency	current_frequency;	// Current frequency tuned
+	ClockTime	dwell_end_time;		// When the dwell on the current frequency ends
 
 	/* FFT variables */
 	int		fft_size;		
 	fftwf_complex*	fftw_in;		// FFT input buffer
 	fftwf_complex*	fftw_out;		// FFT output buffer. [0] is DC, then center to min-freq = max-freq back to centre 
-	fftwf_plan	fftw_plan;		// FFTW's plan
+	fftwf_plan	fftw_plan;		// FFTW's plan, for a whole batch of frames
+	fftwf_plan	fftw_frame_plan;	// Transforms one frame, to finish a partial batch
+	int		requested_batch;	// Frames to transform together, or 0 to choose from the FFT size
+	int		fft_batch;		// Frames transformed together
+	int		batch_fill;		// Whole frames waiting in fftw_in
 	float*		window;			// FFT Window function
-	int		fft_fill;		// Next fftw_in slot to fill
-	float*		fft_power;		// Power per frequency for this FFT
+	float*		window_iq;		// The window times sample_scale, for each of I and Q
+	int		fft_fill;		// Next slot to fill in the frame after batch_fill
+	int		overlap_percent;	// How much of each frame the next one starts with
+	int		frame_hop;		// Samples from the start of one frame to the next
+	char*		frame_samples;		// When frames overlap, the received samples of the frame being filled
+	float*		fft_power;		// Power per frequency for each frame of the batch
 
 	float*		power_accumulation;	// Accumulated power over the entire scan (all tunings)
 	long		accumulation_count;	// How many times have we accumulated power (across all tunings)
+	int*		bucket_frames;		// How many FFT frames were accumulated into each bucket
+	int		span_bin;		// First bucket of the frames not yet counted in bucket_frames
+	int		span_bins;		// How many buckets they cover
+	int		span_frames;		// How many of them there are
 	int		power_buckets;		// Number of accumulated power buckets over the entire scan
 
 	int_least64_t	last_time;		// Returned buffer timestamp or clock time received
 	int_least64_t	first_time;		// First returned buffer timestamp or clock time received
-} ProgramConfiguration;
+
+	/* Multiple receivers. The configuration for the whole scan owns a Receiver for each device */
+	Receiver*	receivers;
+	int		receiver_count;
+	int		receiver_index;		// Which share of the tunings this receiver scans
+	int		receiver_share;		// How many receivers share the tunings (0 = not shared)
+	int		channel_index;		// Which of the device's channels this receiver is
+	int		channel_share;		// How many channels of the device share its tunings
+	ProgramConfiguration* stream_owner;	// The receiver on the same device that reads the stream, if not this
+	ProgramConfiguration** channel_configs;	// The stream owner's receivers, one per channel
+	pthread_mutex_t	receiver_lock;
+	pthread_cond_t	receiver_wake;		// Signalled to start a scan, and as each receiver finishes
+	unsigned	scan_generation;	// Incremented to start a scan on every receiver
+	int		receivers_finished;	// Receivers that have finished this scan
+	bool		receivers_stop;		// Asks the receiver threads to finish
+};
+
+/*
+ * A device, or one channel of it, scanning its share of the tunings on its own DSP thread (and acquisition thread, if any).
+ * It accumulates into its own buckets, which are merged into the whole scan's after each scan.
+ * The channels of one device share a stream, which the first channel's acquisition thread reads into every channel's ring.
+ */
+struct Receiver
+{
+	ProgramConfiguration	config;		// For this device
+	ProgramConfiguration*	scan_config;	// The configuration for the whole scan
+	pthread_t	thread;
+	bool		running;
+	bool		ok;			// The last scan succeeded
+	pthread_mutex_t	device_lock;		// Serialises control calls from the channels sharing this receiver's device
+};
 
 ProgramConfiguration	config;
 int		signals_caught;
@@ -97,17 +507,133 @@ int		signals_caught;
 // Function prototypes:
 bool		scan(ProgramConfiguration* pc);
 bool		retune(ProgramConfiguration* pc, Frequency frequency);
+bool		change_frequency(ProgramConfiguration* pc, Frequency frequency, ClockTime at_time);
+void		mark_config_change(ProgramConfiguration* pc);
+void		lock_device(ProgramConfiguration* pc);
+void		unlock_device(ProgramConfiguration* pc);
+bool		finish_tuning(ProgramConfiguration* pc);
+bool		dwell_received(ProgramConfiguration* pc);
+bool		start_burst(ProgramConfiguration* pc);
 bool		flush_data_after_config_change(ProgramConfiguration* pc);
+void		discard_samples(SampleBlock* block, const StreamFormat* format, double sample_rate, long samples);
+int		device_settle_time(ProgramConfiguration* pc);
+long		driver_queue_samples(ProgramConfiguration* pc);
 bool		receive_block(ProgramConfiguration* pc, Frequency frequency);
-void		process_buffer(ProgramConfiguration* pc, int16_t* buf16, int samples);
-void		handle_fft_out(ProgramConfiguration* pc);
+void		read_blocks(ProgramConfiguration* pc, SampleBlock** blocks, int count);
+SampleBlock*	next_block(ProgramConfiguration* pc);
+void		release_block(ProgramConfiguration* pc);
+void		release_direct_buffer(ProgramConfiguration* pc, SampleBlock* block);
+bool		deliver_block(ProgramConfiguration* pc, SampleBlock* block, long preempted);
+void		account_block(ProgramConfiguration* pc, SampleBlock* block);
+void		add_stream_stats(StreamStats* total, const StreamStats* stats);
+bool		report_stream_stats(FILE* fp, const char* what, Frequency frequency, const StreamStats* stats);
+bool		allocate_buffers(ProgramConfiguration* pc);
+bool		arena_create(Arena* arena, size_t size, bool lock);
+bool		arena_map(Arena* arena, size_t size);
+size_t		arena_huge_bytes(Arena* arena);
+void		report_arena(Arena* arena, FILE* fp);
+void*		arena_alloc(Arena* arena, size_t size);
+void		arena_destroy(Arena* arena);
+void*		acquisition_thread(void* arg);
+bool		start_acquisition(ProgramConfiguration* pc);
+void		stop_acquisition(ProgramConfiguration* pc);
+void		report_ring(ProgramConfiguration* pc, FILE* fp);
+void		report_strongest_bucket(ProgramConfiguration* pc, FILE* fp);
+void		configure_thread(ProgramConfiguration* pc, const char* role, int cpu, int priority);
+void		configure_dsp_thread(ProgramConfiguration* pc);
+bool		initialise_receivers(ProgramConfiguration* pc);
+void*		receiver_thread(void* arg);
+bool		scan_receivers(ProgramConfiguration* pc);
+void		finalise_receivers(ProgramConfiguration* pc);
+char*		receiver_path(const char* path, int index);
+bool		serve(ProgramConfiguration* pc);
+void		serve_client(ProgramConfiguration* pc, ScanRequest* planned, int client);
+void		pause_stream(ProgramConfiguration* pc);
+bool		resume_stream(ProgramConfiguration* pc);
+bool		serve_request(ProgramConfiguration* pc, ScanRequest* planned, char* request, FILE* out);
+bool		replan(ProgramConfiguration* pc);
+void		clear_accumulation(ProgramConfiguration* pc);
+void		count_span_frames(ProgramConfiguration* pc);
+void		write_spectrum(ProgramConfiguration* pc, FILE* fp);
+double		window_gain(ProgramConfiguration* pc);
+long		preemptions_since(long* last);
+void		process_buffer(ProgramConfiguration* pc, const void* iq, int samples);
+void		convert_cs8(const void* iq, float* out, const float* window, int samples);
+void		convert_cu8(const void* iq, float* out, const float* window, int samples);
+void		convert_cs12(const void* iq, float* out, const float* window, int samples);
+void		convert_cs16(const void* iq, float* out, const float* window, int samples);
+void		convert_cf32(const void* iq, float* out, const float* window, int samples);
+void		squared_magnitude(const fftwf_complex* bins, float* out, int count);
+void		accumulate(float* accumulation, const float* power, int count);
+#if defined(X86_KERNELS)
+bool		cpu_has_avx2(void);
+bool		cpu_has_avx512(void);
+void		convert_cs8_avx2(const void* iq, float* out, const float* window, int samples);
+void		convert_cu8_avx2(const void* iq, float* out, const float* window, int samples);
+void		convert_cs16_avx2(const void* iq, float* out, const float* window, int samples);
+void		convert_cf32_avx2(const void* iq, float* out, const float* window, int samples);
+void		squared_magnitude_avx2(const fftwf_complex* bins, float* out, int count);
+void		accumulate_avx2(float* accumulation, const float* power, int count);
+void		convert_cs8_avx512(const void* iq, float* out, const float* window, int samples);
+void		convert_cu8_avx512(const void* iq, float* out, const float* window, int samples);
+void		convert_cs16_avx512(const void* iq, float* out, const float* window, int samples);
+void		convert_cf32_avx512(const void* iq, float* out, const float* window, int samples);
+void		squared_magnitude_avx512(const fftwf_complex* bins, float* out, int count);
+void		accumulate_avx512(float* accumulation, const float* power, int count);
+#endif
+#if defined(NEON_KERNELS)
+void		convert_cs8_neon(const void* iq, float* out, const float* window, int samples);
+void		convert_cu8_neon(const void* iq, float* out, const float* window, int samples);
+void		convert_cs16_neon(const void* iq, float* out, const float* window, int samples);
+void		convert_cf32_neon(const void* iq, float* out, const float* window, int samples);
+void		squared_magnitude_neon(const fftwf_complex* bins, float* out, int count);
+void		accumulate_neon(float* accumulation, const float* power, int count);
+#endif
+bool		select_kernels(ProgramConfiguration* pc);
+SampleConverter	format_converter(const KernelSet* kernels, const StreamFormat* format);
+const StreamFormat* find_stream_format(const char* name);
+void		transform_frames(ProgramConfiguration* pc);
+void		handle_fft_out(ProgramConfiguration* pc, int frames);
+bool		open_recording(ProgramConfiguration* pc);
+bool		read_sigmf_meta(ProgramConfiguration* pc, const char* meta_path);
+const char*	json_value(const char* json, const char* end, const char* key);
+const char*	json_close(const char* json, const char* end);
+ClockTime	json_datetime(const char* value);
+bool		replay(ProgramConfiguration* pc);
+void		close_recording(Recording* recording);
+bool		start_recorder(ProgramConfiguration* pc);
+void*		recorder_thread(void* arg);
+void		record_samples(ProgramConfiguration* pc, const void* iq, int samples, long long buffer_time, ClockTime receive_time);
+void		stop_recorder(ProgramConfiguration* pc);
+bool		write_sigmf_meta(ProgramConfiguration* pc, const char* meta_path, const Capture* captures, int capture_count, const char* annotation);
+bool		start_trigger(ProgramConfiguration* pc);
+void		keep_history(ProgramConfiguration* pc, const void* iq, int samples);
+void		check_trigger(ProgramConfiguration* pc, int peak_bin, float peak_power);
+void		finish_trigger(ProgramConfiguration* pc);
+void*		trigger_thread(void* arg);
+bool		write_trigger_capture(ProgramConfiguration* pc);
+void		stop_trigger(ProgramConfiguration* pc);
+bool		open_synthesiser(ProgramConfiguration* pc);
+bool		parse_signal(Signal* signal, const char* spec, int length);
+void		synthesise_block(ProgramConfiguration* pc, int samples);
+bool		synthesise(ProgramConfiguration* pc);
+void		check_synthesised_signals(ProgramConfiguration* pc, FILE* fp);
+void		close_synthesiser(Synthesiser* synthesiser);
 void		print_soapy_flags(FILE* fp, int flags);
 void		list_sdr_devices(FILE* fp);
 void		list_device_capabilities(ProgramConfiguration* pc);
+void		probe_capabilities(ProgramConfiguration* pc);
+char*		capability_cache_path(ProgramConfiguration* pc);
+bool		load_capabilities(ProgramConfiguration* pc);
+void		save_capabilities(ProgramConfiguration* pc);
 void		list_sample_rates(ProgramConfiguration* pc);
 void		select_sample_rate(ProgramConfiguration* pc);
 const char*	s_if_plural(int i) { return i != 1 ? "s" : ""; }
 bool		initialise_configuration(ProgramConfiguration* pc);
+bool		plan_frequencies(ProgramConfiguration* pc);
+bool		open_device(ProgramConfiguration* pc);
+void		share_stream(ProgramConfiguration* pc);
+void		select_stream_format(ProgramConfiguration* pc);
 void		list_channel_variables(ProgramConfiguration* pc);
 void		plan_tuning(ProgramConfiguration* pc);
 const char*	setup_stream(ProgramConfiguration* pc);
@@ -116,6 +642,10 @@ bool		plan_fft(ProgramConfiguration* pc);
 void		setup_interrupts();
 void		interrupt_request(void);
 ClockTime	clock_time();
+void		start_stream_clock(ProgramConfiguration* pc, ClockTime base);
+void		advance_stream_clock(ProgramConfiguration* pc, long samples);
+ClockTime	stream_time(ProgramConfiguration* pc);
+long		samples_until(ProgramConfiguration* pc, ClockTime time);
 void		default_parameters(ProgramConfiguration* pc);
 Frequency	frequency_from_str(const char* cp);
 void		usage(int exit_code);
@@ -129,6 +659,13 @@ int main(int argc, char **argv)
 	 || !initialise_configuration(pc))	// Figure out how to use them
 		usage(0);
 
+	if (pc->socket_path)
+	{
+		serve(pc);
+		finalise_configuration(pc);
+		exit(0);
+	}
+
 	for (int repetition = 0; pc->repetition_limit == 0 || repetition < pc->repetition_limit; repetition++)
 		if (!scan(pc) || signals_caught >= 1)
 			break;
@@ -139,92 +676,390 @@ int main(int argc, char **argv)
 
 bool scan(ProgramConfiguration* pc)
 {
+	if (pc->recording.data)
+		return replay(pc);
+	if (pc->synthesiser.signals)
+		return synthesise(pc);
+	if (pc->receivers)
+		return scan_receivers(pc);
+
+	lock_device(pc);
 	SoapySDRDevice_setSampleRate(pc->device, SOAPY_SDR_RX, pc->sdr_channel, pc->sample_rate);
+	unlock_device(pc);
 
 	ClockTime	scan_start_time = clock_time();
 	Frequency	frequency = pc->tuning_start;
 
-	for (int i = 0; i < pc->tuning_count; i++, frequency += pc->tuning_bandwidth)
+	memset(&pc->scan_stats, 0, sizeof(pc->scan_stats));
+	for (int i = 0; i < pc->tuning_count; i++, frequency += pc->tuning_step)
 	{
 		if (signals_caught > 1)
 			return false;
+		memset(&pc->tuning_stats, 0, sizeof(pc->tuning_stats));
 		if (!retune(pc, frequency))
 			break;
 
 		// We should have a last_time from the buffer flush during retune. If not, use the scan start time.
-		ClockTime	receive_end_time = pc->last_time + pc->dwell_time;
+		pc->dwell_end_time = pc->last_time + pc->dwell_time;
 
-		while (pc->last_time < receive_end_time)
+		// When pipelined, stop as soon as the dwell has been received. The rest gets processed during the retune.
+		while (pc->last_time < pc->dwell_end_time
+		 && !(pc->burst_mode && pc->burst_remaining <= 0)
+		 && !(pc->pipelined && i+1 < pc->tuning_count && dwell_received(pc)))
 			if (!receive_block(pc, frequency))
 				break;
+
+		add_stream_stats(&pc->scan_stats, &pc->tuning_stats);
+		if (pc->verbose)
+			report_stream_stats(pc->verbose, "Tuning", frequency, &pc->tuning_stats);
 	}
+	transform_frames(pc);
 
+	if (!report_stream_stats(pc->verbose, "Scan", 0, &pc->scan_stats) && !pc->verbose)
+		report_stream_stats(stderr, "Scan", 0, &pc->scan_stats);
+	report_ring(pc, pc->verbose);
+	report_strongest_bucket(pc, pc->verbose);
 	return true;
 }
 
 bool retune(ProgramConfiguration* pc, Frequency frequency)
 {
-	SoapySDRKwargs args = {0};
+	if (pc->pipelined && pc->current_frequency)
+	{		// Retune at the end of the dwell, and process the samples before that while the device settles
+		if (!change_frequency(pc, frequency, pc->dwell_end_time) || !finish_tuning(pc))
+			return false;
+		if (pc->verbose)
+			fprintf(pc->verbose, "Processed %ld samples after retune was issued\n", pc->tail_samples);
+	}
+	else if (!change_frequency(pc, frequency, 0))
+		return false;
+
+	if (pc->burst_mode && !start_burst(pc))
+		return false;
+
+	transform_frames(pc);		// Finish the last tuning's frames
+	pc->fft_fill = 0;		// Don't mix samples from two tunings in one FFT
+	if (!flush_data_after_config_change(pc))
+	{
+		fprintf(stderr, "Error: bad retune at %" PRId64 "Hz\n", frequency);
+		return false;
+	}
+	pc->burst_remaining -= pc->settle_discarded;
+	pc->current_frequency = frequency;
+	return true;
+}
+
+/*
+ * Ask the device for exactly one dwell of whole FFT frames, plus the settle time, then stop.
+ * The driver then has no stale samples to buffer while we retune.
+ */
+bool start_burst(ProgramConfiguration* pc)
+{
+	long	frames = (long)ceil((double)pc->dwell_time * pc->sample_rate / 1000000 / pc->fft_size);
+	long	settle_samples = (long)ceil((double)pc->settle_time * pc->sample_rate / 1000000);
+
+	pc->burst_remaining = frames * pc->fft_size + settle_samples;
+	pc->next_sample_time = 0;		// There's a gap between bursts
+	lock_device(pc);
+	bool	ok = SoapySDRDevice_activateStream(pc->device, pc->stream, SOAPY_SDR_END_BURST, 0, (size_t)pc->burst_remaining) == 0;
+	if (!ok)
+	{
+		fprintf(stderr, "Device doesn't support burst mode, streaming continuously\n");
+		pc->burst_mode = false;
+		ok = SoapySDRDevice_activateStream(pc->device, pc->stream, 0, 0, 0) == 0;
+	}
+	unlock_device(pc);
+	return ok;
+}
+
+// Set the frequency, at the given device time if possible (0 = now)
+bool change_frequency(ProgramConfiguration* pc, Frequency frequency, ClockTime at_time)
+{
+	SoapySDRKwargs	args = {0};
+	long long	command_time = 0;
+
+	lock_device(pc);
+	if (at_time && pc->hardware_time && pc->timed_commands)
+	{		// Schedule the retune exactly at the end of the dwell, or soon after now
+		long long	earliest = SoapySDRDevice_getHardwareTime(pc->device, "") + COMMAND_LEAD_USEC*1000LL;
+		command_time = at_time*1000LL > earliest ? at_time*1000LL : earliest;
+		if (SoapySDRDevice_setCommandTime(pc->device, command_time, "") != 0)
+		{
+			if (pc->verbose)
+				fprintf(pc->verbose, "Device doesn't support timed retunes\n");
+			pc->timed_commands = false;
+			command_time = 0;
+		}
+	}
+
 	if (0 != SoapySDRDevice_setFrequency(pc->device, SOAPY_SDR_RX, pc->sdr_channel, (double)frequency, &args))
 	{
 		fprintf(stderr, "Failed to set frequency %" PRId64 "Hz: %s\n", frequency, SoapySDRDevice_lastError());
+		unlock_device(pc);
 		return false;
 	}
+	if (command_time)
+		SoapySDRDevice_setCommandTime(pc->device, 0, "");	// Later commands are immediate
+	mark_config_change(pc);
+	unlock_device(pc);
 	if (pc->verbose)
 		fprintf(pc->verbose, "Tuned to %" PRId64 "\n", frequency);
-	if (!flush_data_after_config_change(pc))
+
+	if (command_time)
 	{
-		fprintf(stderr, "Error: bad retune at %" PRId64 "Hz\n", frequency);
-		return false;
+		pc->change_time = command_time;
+		pc->settled_time = command_time + pc->settle_time*1000LL;
 	}
-	pc->current_frequency = frequency;
 	return true;
 }
 
-// This piece of crap should be hidden deep inside SoapySDR's APIs. I refuse to dignify it with configuration parameters.
-bool flush_data_after_config_change(ProgramConfiguration* pc)
+/*
+ * Channels streamed from one device each retune from their own DSP thread, but drivers expect one caller at a time.
+ */
+void lock_device(ProgramConfiguration* pc)
+{
+	if (pc->device_lock)
+		pthread_mutex_lock(pc->device_lock);
+}
+
+void unlock_device(ProgramConfiguration* pc)
+{
+	if (pc->device_lock)
+		pthread_mutex_unlock(pc->device_lock);
+}
+
+// Note that samples from before now are no longer valid
+void mark_config_change(ProgramConfiguration* pc)
 {
-	int16_t		waste[MAX_SAMPLES * 2] = {0};
-	int		r, i;
+	// Any read started before now may contain samples from before the change:
+	__atomic_add_fetch(&pc->retune_epoch, 1, __ATOMIC_RELEASE);
+	if (pc->hardware_time)
+	{
+		pc->change_time = SoapySDRDevice_getHardwareTime(pc->device, "");
+		pc->settled_time = pc->change_time + pc->settle_time*1000LL;
+	}
+}
 
-	/* wait for settling and flush buffer */
-	usleep(RETUNE_USLEEP);
+// Has the device delivered all the samples for this dwell, even if we haven't processed them yet?
+bool dwell_received(ProgramConfiguration* pc)
+{
+	if (!pc->acquisition_running)
+		return false;
+	return __atomic_load_n(&pc->ring.newest_time, __ATOMIC_ACQUIRE) >= pc->dwell_end_time;
+}
 
-	void*		buffs[] = { waste };
-	int		flags = 0;
-	long long	buffer_time = 0;	// in nanoseconds (if set; SoapyHackRF doesn't set it)
-	long		timeout = 1000000;	// In microseconds
+/*
+ * After a retune was issued, process the samples captured before it took effect,
+ * as part of the previous tuning. The first block read after the change is left in the ring.
+ */
+bool finish_tuning(ProgramConfiguration* pc)
+{
+	SampleBlock*	block;
+	unsigned	epoch = __atomic_load_n(&pc->retune_epoch, __ATOMIC_ACQUIRE);
 
-	for (i = 0; i < 3; i++)		// REVISIT: Why 3?
+	pc->tail_samples = 0;
+	for (;;)
 	{
-		r = SoapySDRDevice_readStream(pc->device, pc->stream, buffs, MAX_SAMPLES, &flags, &buffer_time, timeout);
-		if (r >= 0)
+		if (!(block = next_block(pc)))
+			return false;
+		account_block(pc, block);
+		if (block->samples < 0)
 		{
-			pc->last_time = flags&SOAPY_SDR_HAS_TIME ? buffer_time/1000 : clock_time();
-			if (!pc->first_time)
-				pc->first_time = pc->last_time;
-			break;
+			release_block(pc);
+			continue;
+		}
+
+		int	samples = block->samples;
+		if (pc->hardware_time && (block->flags&SOAPY_SDR_HAS_TIME))
+		{		// Process up to the change time exactly
+			long	before = (long)((double)(pc->change_time - block->buffer_time) * pc->sample_rate / 1e9);
+			if (before < samples)
+				samples = before < 0 ? 0 : (int)before;
+		}
+		else if ((int)(block->epoch - epoch) >= 0)
+			samples = 0;		// Read started after the change
+
+		record_samples(pc, block->iq, samples, block->flags&SOAPY_SDR_HAS_TIME ? block->buffer_time : 0, block->receive_time);
+		process_buffer(pc, block->iq, samples);
+		pc->tail_samples += samples;
+		if (samples < block->samples)
+		{
+			discard_samples(block, pc->stream_format, pc->sample_rate, samples);
+			return true;
+		}
+		release_block(pc);
+	}
+}
+
+/*
+ * This should be hidden deep inside SoapySDR's APIs, but it isn't.
+ * Discard exactly the samples received before the change took effect, plus the device's settle time.
+ * Using device timestamps where we have them, otherwise counting samples from the first read after the change.
+ * The first good sample is left in the ring for receive_block().
+ */
+bool flush_data_after_config_change(ProgramConfiguration* pc)
+{
+	SampleBlock*	block;
+	int		errors = 0;
+	unsigned	epoch = __atomic_load_n(&pc->retune_epoch, __ATOMIC_ACQUIRE);
+	long		settle_samples = (long)((double)pc->settle_time * pc->sample_rate / 1000000);
+	long		discard_limit = (long)((double)MAX_SETTLE_USEC * pc->sample_rate / 1000000);
+
+	// Without timestamps, there's no telling which queued samples were captured before the change. Drop them all.
+	// A burst is only started after the change, so it has nothing stale queued
+	if (!pc->hardware_time && !pc->burst_mode)
+		settle_samples += pc->queue_samples;
+
+	pc->settle_discarded = 0;
+	for (;;)
+	{
+		if (!(block = next_block(pc)))
+			return false;
+		account_block(pc, block);
+		if ((int)(block->epoch - epoch) < 0)
+		{		// Read started before the change. Its errors don't count against this tuning
+			if (block->samples > 0)
+				pc->settle_discarded += block->samples;
+			release_block(pc);
+			continue;
+		}
+		if (block->samples < 0)
+		{
+			release_block(pc);
+			if (++errors >= 3)
+				return false;
+			continue;
+		}
+
+		long	discard;
+		if (pc->hardware_time && (block->flags&SOAPY_SDR_HAS_TIME))
+		{
+			discard = (long)ceil((double)(pc->settled_time - block->buffer_time) * pc->sample_rate / 1e9);
+			if (discard < 0)
+				discard = 0;
+		}
+		else
+			discard = settle_samples;
+
+		if (pc->hardware_time && pc->settle_discarded + discard > discard_limit)
+		{		// The device clock doesn't agree with its sample timestamps. Count samples instead
+			if (pc->verbose)
+				fprintf(pc->verbose, "Device timestamps don't match its clock, settling by sample count\n");
+			pc->hardware_time = false;
+			if (!pc->burst_mode)
+				settle_samples += pc->queue_samples;
+			discard = settle_samples;
+		}
+
+		if (discard >= block->samples)
+		{
+			pc->settle_discarded += block->samples;
+			settle_samples -= block->samples;
+			release_block(pc);
+			continue;
 		}
+
+		// Settled part way through this block. Keep the rest:
+		discard_samples(block, pc->stream_format, pc->sample_rate, discard);
+		pc->settle_discarded += discard;
+		pc->last_time = block->flags&SOAPY_SDR_HAS_TIME ? block->buffer_time/1000 : block->receive_time;
+		if (!pc->first_time)
+			pc->first_time = pc->last_time;
+		if (pc->verbose)
+			fprintf(pc->verbose, "Settled after discarding %ld samples\n", pc->settle_discarded);
+		return true;
 	}
-	return r >= 0;
+}
+
+// Drop samples from the start of a block
+void discard_samples(SampleBlock* block, const StreamFormat* format, double sample_rate, long samples)
+{
+	block->iq = (const char*)block->iq + samples * format->bytes;
+	block->samples -= samples;
+	block->buffer_time += (long long)(samples * 1e9 / sample_rate);
+}
+
+/*
+ * How long each kind of device takes after a retune before its samples are usable, mostly PLL lock.
+ * Samples queued in the driver from before the change are counted separately, by driver_queue_samples().
+ */
+const struct
+{
+	const char*	driver;
+	int		settle_time;		// microseconds
+} device_settle_times[] =
+{
+	{ "rtlsdr",	10000 },		// R820T PLL, and the tuner's AGC
+	{ "hackrf",	2000 },
+	{ "airspy",	2000 },
+	{ "bladerf",	1000 },
+	{ "lime",	2000 },
+	{ "uhd",	1000 },
+	{ "sdrplay",	10000 },
+	{ "plutosdr",	1000 },
+	{ "powerscan_sim", 2000 },		// Matches its default retune_us
+};
+
+// Look up the settle time for this device driver
+int device_settle_time(ProgramConfiguration* pc)
+{
+	char*		driver = SoapySDRDevice_getDriverKey(pc->device);
+	int		settle_time = RETUNE_USLEEP;
+
+	for (int i = 0; driver && i < sizeof(device_settle_times)/sizeof(device_settle_times[0]); i++)
+		if (strcmp(driver, device_settle_times[i].driver) == 0)
+			settle_time = device_settle_times[i].settle_time;
+	free(driver);
+	return settle_time;
+}
+
+/*
+ * The driver's queue is its number of buffers, from the stream arguments it takes, times the samples in each.
+ * Drivers name the argument differently. If none is given, assume the direct access buffers are the queue.
+ */
+long driver_queue_samples(ProgramConfiguration* pc)
+{
+	static const char*	buffer_keys[] = { "buffers", "num_buffers", "num_recv_frames" };
+	size_t			buffers = SoapySDRDevice_getNumDirectAccessBuffers(pc->device, pc->stream);
+	size_t			length = 0;
+	SoapySDRArgInfo*	info = SoapySDRDevice_getStreamArgsInfo(pc->device, SOAPY_SDR_RX, pc->sdr_channel, &length);
+
+	for (size_t i = 0; i < length; i++)
+		for (int k = 0; k < sizeof(buffer_keys)/sizeof(buffer_keys[0]); k++)
+			if (info[i].key && info[i].value && strcmp(info[i].key, buffer_keys[k]) == 0)
+				buffers = strtoul(info[i].value, 0, 10);
+	SoapySDRArgInfoList_clear(info, length);
+
+	if (buffers < 1)
+		buffers = 1;
+	if (pc->verbose)
+		fprintf(pc->verbose, "Driver queues up to %zu buffer%s of %zu samples\n",
+			buffers, s_if_plural(buffers), SoapySDRDevice_getStreamMTU(pc->device, pc->stream));
+	return (long)(buffers * SoapySDRDevice_getStreamMTU(pc->device, pc->stream));
 }
 
 bool receive_block(ProgramConfiguration* pc, Frequency frequency)
 {
-	int16_t		buf16[MAX_SAMPLES*2];
-	void*		buffers[] = {buf16};
-	int		flags = 0;		// Flags received in the buffer header
-	long long	buffer_time = 0;	// The timestamp on the received buffer
+	SampleBlock*	block;
+	const void*	iq;
+	int		flags;			// Flags received in the buffer header
+	long long	buffer_time;		// The timestamp on the received buffer
 	long long	this_time = 0;		// In microseconds
-	long		timeout = 1000000;	// Timeout on this read (microseconds)
 	int		samples;
 
-	samples = SoapySDRDevice_readStream(pc->device, pc->stream, buffers, MAX_SAMPLES, &flags, &buffer_time, timeout);
+	if (!(block = next_block(pc)))
+		return false;
+	account_block(pc, block);
+	iq = block->iq;
+	samples = block->samples;
+	flags = block->flags;
+	buffer_time = block->buffer_time;
 	if (samples < 0) {
 		fprintf(stderr, "Error: reading stream %d\n", samples);
+		release_block(pc);
 		return false;
 	}
-	this_time = flags&SOAPY_SDR_HAS_TIME ? buffer_time/1000 : clock_time();
+	this_time = flags&SOAPY_SDR_HAS_TIME ? buffer_time/1000 : block->receive_time;
 	if (!pc->first_time)
 		pc->first_time = this_time;
 	if (pc->verbose)
@@ -236,9 +1071,10 @@ bool receive_block(ProgramConfiguration* pc, Frequency frequency)
 			fprintf(pc->verbose, "\n");
 		}
 
-		if (0)
+		if (0 && strcmp(pc->stream_format->name, SOAPY_SDR_CS16) == 0)
 		{
 			// Look at the dynamic range of the data
+			const int16_t* buf16 = (const int16_t*)iq;
 			int min = 32767, max = -32767;
 			for (int s = 0; s < 2*samples; s++) {
 				if (min > buf16[s])
@@ -252,65 +1088,2796 @@ bool receive_block(ProgramConfiguration* pc, Frequency frequency)
 		// Automatic gain control here?
 	}
 	pc->last_time = this_time;
+	pc->burst_remaining -= samples;
+	if (flags&SOAPY_SDR_END_BURST)
+		pc->burst_remaining = 0;
 
-	process_buffer(pc, buf16, samples);
+	record_samples(pc, iq, samples, flags&SOAPY_SDR_HAS_TIME ? buffer_time : 0, block->receive_time);
+	process_buffer(pc, iq, samples);
+	release_block(pc);
 	return true;
 }
 
-void process_buffer(ProgramConfiguration* pc, int16_t* buf16, int samples)
+/*
+ * Read one buffer from the device into these blocks, one for each channel in the stream,
+ * or point the block at a driver buffer when there's only one.
+ */
+void read_blocks(ProgramConfiguration* pc, SampleBlock** blocks, int count)
 {
-	while (samples > 0)
+	ProgramConfiguration** channels = pc->channel_configs ? pc->channel_configs : &pc;
+	SampleBlock*	block = blocks[0];
+
+	for (int c = 0; c < count; c++)
+		blocks[c]->epoch = __atomic_load_n(&channels[c]->retune_epoch, __ATOMIC_ACQUIRE);
+	block->flags = 0;
+	block->buffer_time = 0;
+	block->handle = -1;
+	if (pc->direct_buffers)
 	{
-		fftwf_complex	c = (float)buf16[0] + I*(float)buf16[1];
-		// Normalise samples to 0..1, multiplied by the window function
-		pc->fftw_in[pc->fft_fill] = c * pc->window[pc->fft_fill] / 32768;
-		buf16 += 2;
-		samples--;
-		if (++pc->fft_fill >= pc->fft_size)
+		size_t		handle;
+		const void*	buffers[1];
+
+		block->samples = SoapySDRDevice_acquireReadBuffer(pc->device, pc->stream, &handle, buffers, &block->flags, &block->buffer_time, READ_TIMEOUT);
+		if (block->samples >= 0)
 		{
-			fftwf_execute(pc->fftw_plan);
-			handle_fft_out(pc);
-			pc->fft_fill = 0;
+			block->iq = buffers[0];
+			block->handle = handle;
 		}
 	}
-}
+	else
+	{
+		void*		buffers[MAX_STREAM_CHANNELS];
 
-void	handle_fft_out(ProgramConfiguration* pc)
-{
-	for (int s = 1; s < pc->fft_size; s++)
+		for (int c = 0; c < count; c++)
+			buffers[c] = blocks[c]->buffer;
+		block->samples = SoapySDRDevice_readStream(pc->device, pc->stream, buffers, MAX_SAMPLES, &block->flags, &block->buffer_time, READ_TIMEOUT);
+		block->iq = block->buffer;
+	}
+	block->receive_time = clock_time();
+	block->overflows = 0;
+	block->timeouts = 0;
+	block->dropped = 0;
+	block->preemptions = 0;
+	block->preempted_drops = 0;
+	block->accounted = false;
+
+	// Every channel's samples arrived together:
+	for (int c = 1; c < count; c++)
 	{
-		// fftw_out[0] is DC, then center to min-freq = max-freq back to centre 
-		// REVISIT: Re-order the FFT output bins from min-freq to max-freq
-		pc->fft_power[s-1] = cabs(pc->fftw_out[s] /* /pc->fft_size */);
+		SampleBlock	channel_block = *block;
+
+		channel_block.buffer = blocks[c]->buffer;
+		channel_block.iq = blocks[c]->buffer;
+		channel_block.epoch = blocks[c]->epoch;
+		*blocks[c] = channel_block;
 	}
+}
 
-	// REVISIT: Accumulate bin power variance?
+// Return a driver buffer that read_block() received in place
+void release_direct_buffer(ProgramConfiguration* pc, SampleBlock* block)
+{
+	if (block->handle < 0)
+		return;
+	SoapySDRDevice_releaseReadBuffer(pc->device, pc->stream, (size_t)block->handle);
+	block->handle = -1;
+}
 
-	// Summarise into 80 bins for terminal output:
-	if (0)
+/*
+ * Count the problems reported with this block, and check its timestamp follows on from the last one.
+ * An FFT frame interrupted by lost samples is not accumulated.
+ */
+void account_block(ProgramConfiguration* pc, SampleBlock* block)
+{
+	StreamStats*	stats = &pc->tuning_stats;
+	bool		discontinuity = block->overflows > 0 || block->dropped > 0;
+
+	if (block->accounted)
+		return;
+	block->accounted = true;
+
+	stats->overflows += block->overflows;
+	stats->timeouts += block->timeouts;
+	stats->dropped_samples += block->dropped;
+	stats->preemptions += block->preemptions;
+	stats->preempted_drops += block->preempted_drops;
+	if (block->samples == SOAPY_SDR_TIMEOUT)
+		;		// Nothing arrived, but nothing was lost either. The next timestamp will tell
+	else if (block->samples < 0)
 	{
-		int	width = 79;
-		int	stride = (pc->fft_size-1)/width;
-		for (int s = 0; s < pc->fft_size-stride; s += stride)
+		stats->errors++;
+		pc->next_sample_time = 0;
+		discontinuity = true;
+	}
+	else if (block->flags&SOAPY_SDR_HAS_TIME)
+	{
+		if (pc->next_sample_time)
 		{
-			float sum = 0;
-			for (int j = 0; j < stride; j++)
-				sum += pc->fft_power[s+j];
-			fprintf(stderr, "%d: %d\n", s/stride, (int)floor(sum/stride));
+			long	gap = lround((double)(block->buffer_time - pc->next_sample_time) * pc->sample_rate / 1e9);
+			if (gap > 1 || gap < -1)
+			{
+				discontinuity = true;
+				// Samples the ring had no room for are already counted as dropped. Lost ones never reached it
+				if (gap > block->dropped)
+					stats->lost_samples += gap - block->dropped;
+			}
 		}
-		exit(0);
+		pc->next_sample_time = block->buffer_time + (long long)(block->samples * 1e9 / pc->sample_rate);
 	}
 
-	Frequency	lowest_frequency_retained = (pc->current_frequency-pc->tuning_bandwidth/2);
-	int		lowest_bin = (lowest_frequency_retained - pc->start_frequency)/pc->frequency_resolution;
-	int		bin_count = pc->tuning_bandwidth/pc->frequency_resolution;
+	if (discontinuity && pc->fft_fill > 0)
+	{
+		stats->discarded_frames++;
+		pc->fft_fill = 0;
+	}
+}
+
+void add_stream_stats(StreamStats* total, const StreamStats* stats)
+{
+	total->overflows += stats->overflows;
+	total->timeouts += stats->timeouts;
+	total->errors += stats->errors;
+	total->lost_samples += stats->lost_samples;
+	total->dropped_samples += stats->dropped_samples;
+	total->discarded_frames += stats->discarded_frames;
+	total->preemptions += stats->preemptions;
+	total->preempted_drops += stats->preempted_drops;
+}
+
+// Report any receive problems. Returns true if there were some
+bool report_stream_stats(FILE* fp, const char* what, Frequency frequency, const StreamStats* stats)
+{
+	if (!fp)
+		return false;
+	if (!stats->overflows && !stats->timeouts && !stats->errors
+	 && !stats->lost_samples && !stats->dropped_samples && !stats->discarded_frames)
+		return false;
+
+	fprintf(fp, "%s", what);
+	if (frequency)
+		fprintf(fp, " at %" PRId64 "Hz", frequency);
+	fprintf(fp,
+		": %ld overflow%s (%ld after preemption), %ld timeout%s, %ld error%s, %ld samples lost, %ld samples dropped, %ld frame%s discarded, %ld preemption%s\n",
+		stats->overflows, s_if_plural(stats->overflows),
+		stats->preempted_drops,
+		stats->timeouts, s_if_plural(stats->timeouts),
+		stats->errors, s_if_plural(stats->errors),
+		stats->lost_samples,
+		stats->dropped_samples,
+		stats->discarded_frames, s_if_plural(stats->discarded_frames),
+		stats->preemptions, s_if_plural(stats->preemptions)
+	);
+	return true;
+}
+
+// Get the next block of samples from the acquisition thread, or read it here if there isn't one
+SampleBlock* next_block(ProgramConfiguration* pc)
+{
+	SampleRing*	ring = &pc->ring;
+	ClockTime	wait_start = 0;
+
+	if (!pc->acquisition_running)
+	{		// Read here, unless the last block wasn't released
+		SampleBlock*	block = &ring->blocks[0];
+		int		overflows = 0;
+		int		timeouts = 0;
+
+		// Like the acquisition thread, count one read timing out and try again. Give up when the next one fails too
+		if (!ring->held)
+			do {
+				read_blocks(pc, &block, 1);
+				if (block->samples == SOAPY_SDR_OVERFLOW)
+					overflows++;
+				else if (block->samples == SOAPY_SDR_TIMEOUT)
+					timeouts++;
+			} while ((block->samples == SOAPY_SDR_OVERFLOW || (block->samples == SOAPY_SDR_TIMEOUT && timeouts < 2))
+			 && signals_caught <= 1);
+		block->preemptions = (int)preemptions_since(&ring->involuntary_switches);
+		if (overflows && block->preemptions)
+			block->preempted_drops = overflows;
+		block->overflows += overflows;
+		block->timeouts += timeouts;
+		ring->held = true;
+		return block;
+	}
+
+	while (__atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) == ring->tail)
+	{
+		if (signals_caught > 1)
+			return 0;
+		if (!wait_start)
+			wait_start = clock_time();
+		else if (clock_time() - wait_start > 2*READ_TIMEOUT)
+		{		// One read timing out is only counted. Give up when the next one fails too
+			fprintf(stderr, "Error: no samples received in %dms\n", 2*READ_TIMEOUT/1000);
+			return 0;
+		}
+		usleep(RING_POLL_USLEEP);
+	}
+	return &ring->blocks[ring->tail & (ring->size-1)];
+}
+
+// The DSP has finished with the block returned by next_block
+void release_block(ProgramConfiguration* pc)
+{
+	SampleRing*	ring = &pc->ring;
+
+	if (!pc->acquisition_running)
+	{
+		release_direct_buffer(pc, &ring->blocks[0]);
+		ring->held = false;
+		return;
+	}
+	release_direct_buffer(pc, &ring->blocks[ring->tail & (ring->size-1)]);
+	__atomic_store_n(&ring->tail, ring->tail+1, __ATOMIC_RELEASE);
+}
+
+/*
+ * Allocate every buffer used during the scan from one arena, sized from the plan.
+ * Nothing more is allocated until finalise_configuration() frees it.
+ */
+bool allocate_buffers(ProgramConfiguration* pc)
+{
+	SampleRing*	ring = &pc->ring;
+	size_t		block_bytes = (size_t)pc->stream_format->bytes * MAX_SAMPLES;
+
+	// The history must hold both windows, plus the buffer being processed when the post-trigger window ends:
+	if (pc->triggered)
+		pc->trigger.capacity = (long)((pc->trigger.pre_ms + pc->trigger.post_ms) * pc->sample_rate / 1000) + MAX_SAMPLES + pc->fft_size;
+
+	// Round up to a power of two, so the indices can wrap freely:
+	for (ring->size = 1; ring->size < pc->ring_blocks; ring->size <<= 1)
+		;
+
+	if (!arena_create(
+		&pc->arena,
+		ARENA_ROUND(sizeof(SampleBlock) * ring->size)
+		+ ARENA_ROUND(block_bytes) * (ring->size + 1)			// Ring blocks and the overrun block
+		+ ARENA_ROUND(sizeof(fftwf_complex) * pc->fft_size * pc->fft_batch) * 2	// fftw_in and fftw_out
+		+ ARENA_ROUND(sizeof(float) * pc->fft_size)			// window
+		+ ARENA_ROUND(sizeof(float) * pc->fft_size * pc->fft_batch)	// fft_power
+		+ ARENA_ROUND(sizeof(float) * 2 * pc->fft_size)			// window_iq
+		+ (pc->frame_hop < pc->fft_size ? ARENA_ROUND((size_t)pc->stream_format->bytes * pc->fft_size) : 0)	// frame_samples
+		+ ARENA_ROUND(sizeof(float) * pc->power_buckets)		// power_accumulation
+		+ ARENA_ROUND(sizeof(int) * pc->power_buckets)			// bucket_frames
+		+ (pc->synthesiser.signals ? ARENA_ROUND(sizeof(fftwf_complex) * MAX_SAMPLES) : 0)	// Synthesised samples
+		+ (pc->record_base ? RECORD_ALIGN + (size_t)RECORD_CHUNK_BYTES * RECORD_CHUNKS : 0)	// Recording chunks
+		+ (pc->triggered
+		  ? ARENA_ROUND(pc->stream_format->bytes * pc->trigger.capacity)			// Trigger history
+		  + ARENA_ROUND(pc->stream_format->bytes * pc->trigger.capacity)			// and the capture being written
+		  : 0),
+		pc->lock_memory
+	))
+		return false;
+
+	ring->blocks = (SampleBlock*)arena_alloc(&pc->arena, sizeof(SampleBlock) * ring->size);
+	for (int i = 0; i < ring->size; i++)
+		ring->blocks[i].buffer = arena_alloc(&pc->arena, block_bytes);
+	ring->overrun.buffer = arena_alloc(&pc->arena, block_bytes);
+
+	pc->fftw_in = (fftwf_complex*)arena_alloc(&pc->arena, sizeof(fftwf_complex) * pc->fft_size * pc->fft_batch);
+	pc->fftw_out = (fftwf_complex*)arena_alloc(&pc->arena, sizeof(fftwf_complex) * pc->fft_size * pc->fft_batch);
+	pc->window = (float*)arena_alloc(&pc->arena, sizeof(float) * pc->fft_size);
+	pc->window_iq = (float*)arena_alloc(&pc->arena, sizeof(float) * 2 * pc->fft_size);
+	pc->fft_power = (float*)arena_alloc(&pc->arena, sizeof(float) * pc->fft_size * pc->fft_batch);
+	pc->frame_samples = pc->frame_hop < pc->fft_size ? (char*)arena_alloc(&pc->arena, (size_t)pc->stream_format->bytes * pc->fft_size) : 0;
+	pc->power_accumulation = (float*)arena_alloc(&pc->arena, sizeof(float) * pc->power_buckets);
+	pc->bucket_frames = (int*)arena_alloc(&pc->arena, sizeof(int) * pc->power_buckets);
+	pc->span_frames = 0;
+	if (pc->synthesiser.signals)
+		pc->synthesiser.buffer = (fftwf_complex*)arena_alloc(&pc->arena, sizeof(fftwf_complex) * MAX_SAMPLES);
+	if (pc->record_base)
+	{
+		char*	chunks = (char*)arena_alloc(&pc->arena, RECORD_ALIGN + (size_t)RECORD_CHUNK_BYTES * RECORD_CHUNKS);
+		pc->recorder.chunks = (char*)(((uintptr_t)chunks + RECORD_ALIGN-1) & ~(uintptr_t)(RECORD_ALIGN-1));
+	}
+	if (pc->triggered)
+	{
+		pc->trigger.history = (char*)arena_alloc(&pc->arena, pc->stream_format->bytes * pc->trigger.capacity);
+		pc->trigger.event = (char*)arena_alloc(&pc->arena, pc->stream_format->bytes * pc->trigger.capacity);
+	}
+
+	// Blocks waiting in the ring may hold driver buffers. Leave at least half of those for the driver to fill:
+	ring->limit = ring->size;
+	if (pc->direct_buffers && ring->limit > pc->direct_buffers/2)
+		ring->limit = pc->direct_buffers/2 > 0 ? pc->direct_buffers/2 : 1;
+
+	if (pc->lock_memory || pc->verbose)
+		report_arena(&pc->arena, stderr);
+	return true;
+}
+
+/*
+ * Allocate the arena, zeroed and with every page touched.
+ * If asked to lock it, try for huge pages first to avoid TLB misses, then lock it so it can't page out.
+ */
+bool arena_create(Arena* arena, size_t size, bool lock)
+{
+	memset(arena, 0, sizeof(*arena));
+	if (!lock || !arena_map(arena, size))
+	{
+#ifdef _WIN32
+		arena->base = (char*)_aligned_malloc(size, ARENA_ALIGN);
+#else
+		if (posix_memalign((void**)&arena->base, ARENA_ALIGN, size) != 0)
+			arena->base = 0;
+#endif
+		if (!arena->base)
+			return false;
+	}
+	memset(arena->base, 0, size);
+	arena->size = size;
+
+#ifndef _WIN32
+	if (lock)
+		arena->locked = mlock(arena->base, size) == 0;
+#endif
+	return true;
+}
+
+// Map the arena from huge pages: explicit ones if configured, otherwise transparent ones
+bool arena_map(Arena* arena, size_t size)
+{
+#ifdef _WIN32
+	return false;
+#else
+	size_t		mapped = (size + HUGE_PAGE_SIZE-1) & ~(size_t)(HUGE_PAGE_SIZE-1);
+	void*		p = MAP_FAILED;
+
+#ifdef MAP_HUGETLB
+	p = mmap(0, mapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS|MAP_HUGETLB, -1, 0);
+	arena->huge_pages = p != MAP_FAILED;
+#endif
+	if (p == MAP_FAILED)
+	{
+		p = mmap(0, mapped, PROT_READ|PROT_WRITE, MAP_PRIVATE|MAP_ANONYMOUS, -1, 0);
+		if (p == MAP_FAILED)
+			return false;
+#ifdef MADV_HUGEPAGE
+		madvise(p, mapped, MADV_HUGEPAGE);
+#endif
+	}
+	arena->base = (char*)p;
+	arena->mapped = mapped;
+	return true;
+#endif
+}
+
+// How much of the arena is backed by huge pages?
+size_t arena_huge_bytes(Arena* arena)
+{
+	size_t		huge = 0;
+
+	if (arena->huge_pages)
+		return arena->mapped;
+#ifdef __linux__
+	// Transparent huge pages aren't guaranteed, so ask the kernel what we got:
+	FILE*		fp = fopen("/proc/self/smaps", "r");
+	char		line[256];
+	bool		in_arena = false;
+
+	if (!fp || !arena->mapped)
+	{
+		if (fp)
+			fclose(fp);
+		return 0;
+	}
+	while (fgets(line, sizeof(line), fp))
+	{
+		unsigned long	start, end;
+		size_t		kb;
+
+		if (sscanf(line, "%lx-%lx ", &start, &end) == 2)
+			in_arena = (char*)start <= arena->base && arena->base < (char*)end;
+		else if (in_arena && sscanf(line, "AnonHugePages: %zu kB", &kb) == 1)
+			huge += kb * 1024;
+	}
+	fclose(fp);
+#endif
+	return huge;
+}
+
+void report_arena(Arena* arena, FILE* fp)
+{
+	size_t		huge = arena_huge_bytes(arena);
+
+	fprintf(fp, "Buffers: %zuKB", arena->size/1024);
+	if (huge)
+		fprintf(fp, ", %zuKB in %s huge pages", huge/1024, arena->huge_pages ? "explicit" : "transparent");
+	else
+		fprintf(fp, ", no huge pages");
+	fprintf(fp, ", %s\n", arena->locked ? "locked in memory" : "not locked");
+}
+
+// Carve an aligned buffer from the arena. The arena is sized in advance, so this can't fail
+void* arena_alloc(Arena* arena, size_t size)
+{
+	void*		p = arena->base + arena->used;
+
+	arena->used += ARENA_ROUND(size);
+	assert(arena->used <= arena->size);
+	return p;
+}
+
+void arena_destroy(Arena* arena)
+{
+	if (!arena->base)
+		return;
+#ifdef _WIN32
+	_aligned_free(arena->base);
+#else
+	if (arena->locked)
+		munlock(arena->base, arena->size);
+	if (arena->mapped)
+		munmap(arena->base, arena->mapped);
+	else
+		free(arena->base);
+#endif
+	memset(arena, 0, sizeof(*arena));
+}
+
+// Drain the device into the sample ring (or each channel's ring) as fast as it delivers
+void* acquisition_thread(void* arg)
+{
+	ProgramConfiguration* pc = (ProgramConfiguration*)arg;
+	ProgramConfiguration** channels = pc->channel_configs ? pc->channel_configs : &pc;
+	int		channel_count = pc->channel_configs ? pc->stream_channels : 1;
+	SampleBlock*	blocks[MAX_STREAM_CHANNELS];
+
+	configure_thread(pc, "receive thread", pc->receive_cpu, pc->receive_priority);
+	preemptions_since(&pc->ring.involuntary_switches);
+
+#ifndef _WIN32
+	// Leave signal handling to the main thread:
+	sigset_t	signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGINT);
+	sigaddset(&signals, SIGTERM);
+	sigaddset(&signals, SIGQUIT);
+	pthread_sigmask(SIG_BLOCK, &signals, NULL);
+#endif
+
+	while (!__atomic_load_n(&pc->acquisition_stop, __ATOMIC_ACQUIRE))
+	{
+		bool		error = false;
+
+		for (int c = 0; c < channel_count; c++)
+		{
+			SampleRing*	ring = &channels[c]->ring;
+			unsigned	waiting = ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+			// If the DSP isn't keeping up, keep the device drained anyway
+			blocks[c] = waiting >= ring->limit ? &ring->overrun : &ring->blocks[ring->head & (ring->size-1)];
+		}
+		read_blocks(pc, blocks, channel_count);
+
+		// Was this thread preempted since the last read? If the driver overflowed too, that's probably why
+		long		preempted = preemptions_since(&pc->ring.involuntary_switches);
+		for (int c = 0; c < channel_count; c++)
+			if (deliver_block(channels[c], blocks[c], preempted))
+				error = true;
+		if (error)
+			usleep(RETUNE_USLEEP);	// Don't flood the ring with errors
+	}
+	return 0;
+}
+
+// Pass a block just read to the DSP, or count what went wrong with it. Returns true if it's an error
+bool deliver_block(ProgramConfiguration* pc, SampleBlock* block, long preempted)
+{
+	SampleRing*	ring = &pc->ring;
+	unsigned	waiting = ring->head - __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+
+	ring->preemptions += preempted;
+	if (block == &ring->overrun)
+	{
+		if (block->samples >= 0)
+		{
+			ring->overruns++;
+			ring->dropped += block->samples;
+		}
+		else if (block->samples == SOAPY_SDR_OVERFLOW)
+		{
+			ring->overflows++;
+			if (preempted)
+				ring->preempted_drops++;
+		}
+		release_direct_buffer(pc, block);
+		return false;
+	}
+
+	if (block->samples == SOAPY_SDR_TIMEOUT)
+	{
+		if (!pc->burst_mode)	// Expected between bursts
+			ring->timeouts++;
+		return false;
+	}
+	if (block->samples == SOAPY_SDR_OVERFLOW)
+	{
+		ring->overflows++;
+		if (preempted)
+			ring->preempted_drops++;
+		return false;
+	}
+	block->overflows = ring->overflows;
+	block->timeouts = ring->timeouts;
+	block->dropped = ring->dropped;
+	block->preemptions = ring->preemptions;
+	block->preempted_drops = ring->preempted_drops;
+	ring->overflows = ring->timeouts = ring->preemptions = ring->preempted_drops = 0;
+	ring->dropped = 0;
+
+	__atomic_store_n(&ring->head, ring->head+1, __ATOMIC_RELEASE);
+	ring->blocks_received++;
+	if (block->samples > 0)
+		__atomic_store_n(
+			&ring->newest_time,
+			(block->flags&SOAPY_SDR_HAS_TIME
+				? block->buffer_time/1000 + (ClockTime)(block->samples * 1e6 / pc->sample_rate)
+				: block->receive_time),
+			__ATOMIC_RELEASE
+		);
+	if (waiting+1 > ring->high_water)
+		ring->high_water = waiting+1;
+
+	return block->samples < 0;
+}
+
+bool start_acquisition(ProgramConfiguration* pc)
+{
+	if (pc->ring_blocks > 1)
+	{
+		pc->acquisition_stop = false;
+		if (pthread_create(&pc->acquisition_thread, NULL, acquisition_thread, pc) == 0)
+			pc->acquisition_running = true;
+		else
+			fprintf(stderr, "Unable to start acquisition thread, reading on the DSP thread\n");
+	}
+
+	// A shared receiver's DSP runs on its own thread, which configures itself
+	if (!pc->receiver_share)
+		configure_dsp_thread(pc);
+	return true;
+}
+
+void configure_dsp_thread(ProgramConfiguration* pc)
+{
+	if (pc->acquisition_running)
+		configure_thread(pc, "DSP thread", pc->dsp_cpu, 0);
+	else
+	{		// This thread receives as well
+		configure_thread(pc, "receive and DSP thread", pc->receive_cpu >= 0 ? pc->receive_cpu : pc->dsp_cpu, pc->receive_priority);
+		preemptions_since(&pc->ring.involuntary_switches);
+	}
+}
+
+// Pin the calling thread to a CPU and give it real-time priority, as requested
+void configure_thread(ProgramConfiguration* pc, const char* role, int cpu, int priority)
+{
+#ifdef __linux__
+	if (cpu >= 0)
+	{
+		cpu_set_t	cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(cpu, &cpus);
+		if (pthread_setaffinity_np(pthread_self(), sizeof(cpus), &cpus) != 0)
+			fprintf(stderr, "Unable to pin %s to CPU %d\n", role, cpu);
+		else if (pc->verbose)
+			fprintf(pc->verbose, "Pinned %s to CPU %d\n", role, cpu);
+	}
+#endif
+#ifndef _WIN32
+	if (priority > 0)
+	{
+		struct sched_param	param = {0};
+		int		error;
+
+		param.sched_priority = priority;
+		if ((error = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param)) != 0)
+			fprintf(stderr, "Unable to give %s SCHED_FIFO priority %d: %s\n", role, priority, strerror(error));
+		else if (pc->verbose)
+			fprintf(pc->verbose, "Running %s at SCHED_FIFO priority %d\n", role, priority);
+	}
+#endif
+}
+
+// How many times has the calling thread been preempted since the last call?
+long preemptions_since(long* last)
+{
+	long		preemptions = 0;
+#ifdef RUSAGE_THREAD
+	struct rusage	usage;
+
+	if (getrusage(RUSAGE_THREAD, &usage) == 0)
+	{
+		preemptions = usage.ru_nivcsw - *last;
+		*last = usage.ru_nivcsw;
+	}
+#endif
+	return preemptions;
+}
+
+void stop_acquisition(ProgramConfiguration* pc)
+{
+	if (!pc->acquisition_running)
+		return;
+	if (!pc->stream_owner)		// Otherwise the owner's thread fills this ring, and has stopped already
+	{
+		__atomic_store_n(&pc->acquisition_stop, true, __ATOMIC_RELEASE);
+		pthread_join(pc->acquisition_thread, NULL);
+	}
+	report_ring(pc, stderr);
+	pc->acquisition_running = false;
+}
+
+// Report how full the sample ring has been, so it can be sized for the sample rate
+void report_ring(ProgramConfiguration* pc, FILE* fp)
+{
+	SampleRing*	ring = &pc->ring;
+
+	if (!fp || !pc->acquisition_running)
+		return;
+	unsigned	waiting = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE) - ring->tail;
+	fprintf(fp,
+		"Sample ring: %u of %d blocks waiting, high-water %u (%d%%), %ld block%s received, %ld overrun%s\n",
+		waiting,
+		ring->size,
+		ring->high_water,
+		(int)(100 * ring->high_water / ring->size),
+		ring->blocks_received,
+		s_if_plural(ring->blocks_received),
+		ring->overruns,
+		s_if_plural(ring->overruns)
+	);
+}
+
+// Report where the strongest signal was accumulated, to check it lands in the bucket for its frequency
+void report_strongest_bucket(ProgramConfiguration* pc, FILE* fp)
+{
+	double		mean = 0;
+	int		peak = 0;
+
+	if (!fp || pc->power_buckets <= 0)
+		return;
+	for (int b = 0; b < pc->power_buckets; b++)
+	{
+		mean += pc->power_accumulation[b];
+		if (pc->power_accumulation[b] > pc->power_accumulation[peak])
+			peak = b;
+	}
+	mean /= pc->power_buckets;
+	fprintf(fp, "Strongest bucket %d at %" PRId64 "Hz, %.1fdB over the mean\n",
+		peak, pc->start_frequency + peak * pc->frequency_resolution,
+		mean > 0 ? 10 * log10(pc->power_accumulation[peak] / mean) : 0);
+}
+
+/*
+ * Open every device, each with its own copy of the configuration and its share of the tunings,
+ * and start a DSP thread for each. They must agree on the sample rate, so their buckets line up.
+ * When streaming several channels, each channel of each device is a receiver.
+ */
+bool initialise_receivers(ProgramConfiguration* pc)
+{
+	int		stride = pc->receive_cpu >= 0 && pc->dsp_cpu >= 0 ? 2 : 1;	// CPUs used by each receiver
+	int		devices = pc->sdr_name_count > 1 ? pc->sdr_name_count : 1;
+	int		channels = pc->stream_channels > 1 ? pc->stream_channels : 1;
+
+	if (channels > 1 && pc->ring_blocks <= 1)
+	{
+		fprintf(stderr, "Channels streamed together need an acquisition thread, using %d blocks\n", RING_BLOCKS);
+		pc->ring_blocks = RING_BLOCKS;
+	}
+	pc->receiver_count = devices * channels;
+	pc->receivers = (Receiver*)calloc(pc->receiver_count, sizeof(Receiver));
+	for (int i = 0; i < pc->receiver_count; i++)
+	{
+		Receiver*		receiver = &pc->receivers[i];
+		ProgramConfiguration*	rc = &receiver->config;
+		int			channel = i % channels;
+
+		*rc = *pc;
+		rc->receivers = 0;
+		rc->receiver_count = 0;
+		if (pc->sdr_names)
+			rc->sdr_name = pc->sdr_names[i / channels];
+		rc->receiver_index = i / channels;
+		rc->receiver_share = devices;
+		rc->channel_index = channel;
+		rc->channel_share = channels;
+		rc->sdr_channel = pc->sdr_channel + channel;
+		if (channel > 0)
+			rc->stream_owner = &pc->receivers[i - channel].config;
+		if (channels > 1)
+		{		// The device's first channel has the lock they all share
+			if (channel == 0)
+				pthread_mutex_init(&receiver->device_lock, 0);
+			rc->device_lock = &pc->receivers[i - channel].device_lock;
+		}
+		if (rc->receive_cpu >= 0)
+			rc->receive_cpu += i*stride;
+		if (rc->dsp_cpu >= 0)
+			rc->dsp_cpu += i*stride;
+		if (rc->record_base)
+			rc->record_base = receiver_path(pc->record_base, i);
+		rc->trigger.prefix = receiver_path(pc->trigger.prefix, i);
+		receiver->scan_config = pc;
+
+		if (pc->verbose)
+			fprintf(pc->verbose, "Receiver %d is %s channel %d\n", i, rc->sdr_name ? rc->sdr_name : "(default)", rc->sdr_channel);
+		if (!initialise_configuration(rc))
+			return false;
+		if (rc->sample_rate != pc->receivers[0].config.sample_rate)
+		{
+			const char*	first = pc->receivers[0].config.sdr_name;
+
+			fprintf(stderr, "Receiver %d (%s) uses %g samples/s, not %g like receiver 0 (%s)\n",
+				i, rc->sdr_name ? rc->sdr_name : "(default)", rc->sample_rate,
+				pc->receivers[0].config.sample_rate, first ? first : "(default)");
+			return false;
+		}
+	}
+
+	// Now every channel has its ring, each device's first channel can read the stream into them all:
+	for (int i = 0; channels > 1 && i < pc->receiver_count; i += channels)
+	{
+		ProgramConfiguration*	owner = &pc->receivers[i].config;
+
+		owner->channel_configs = (ProgramConfiguration**)calloc(channels, sizeof(ProgramConfiguration*));
+		for (int c = 0; c < channels; c++)
+			owner->channel_configs[c] = &pc->receivers[i+c].config;
+		if (!start_acquisition(owner))
+			return false;
+		if (!owner->acquisition_running)
+		{
+			fprintf(stderr, "Channels streamed together need an acquisition thread\n");
+			return false;
+		}
+		for (int c = 1; c < channels; c++)
+			owner->channel_configs[c]->acquisition_running = true;
+	}
+
+	// The whole scan is described by any of the receivers:
+	ProgramConfiguration*	first = &pc->receivers[0].config;
+	pc->sample_rate = first->sample_rate;
+	pc->start_frequency = first->start_frequency;
+	pc->end_frequency = first->end_frequency;
+	pc->frequency_resolution = first->frequency_resolution;
+	pc->power_buckets = first->power_buckets;
+	pc->tuning_bandwidth = first->tuning_bandwidth;
+	pc->tuning_step = first->tuning_bandwidth;
+	pc->dwell_time = first->dwell_time;
+	if (!arena_create(&pc->arena, ARENA_ROUND(sizeof(float) * pc->power_buckets) + ARENA_ROUND(sizeof(int) * pc->power_buckets), pc->lock_memory))
+		return false;
+	pc->power_accumulation = (float*)arena_alloc(&pc->arena, sizeof(float) * pc->power_buckets);
+	pc->bucket_frames = (int*)arena_alloc(&pc->arena, sizeof(int) * pc->power_buckets);
+
+	pthread_mutex_init(&pc->receiver_lock, 0);
+	pthread_cond_init(&pc->receiver_wake, 0);
+	for (int i = 0; i < pc->receiver_count; i++)
+	{
+		Receiver*	receiver = &pc->receivers[i];
+		if (pthread_create(&receiver->thread, 0, receiver_thread, receiver) != 0)
+		{
+			fprintf(stderr, "Unable to start a thread for receiver %s\n", receiver->config.sdr_name);
+			return false;
+		}
+		receiver->running = true;
+	}
+	return true;
+}
+
+// Scan this receiver's share of the tunings each time the whole scan starts
+void* receiver_thread(void* arg)
+{
+	Receiver*		receiver = (Receiver*)arg;
+	ProgramConfiguration*	pc = receiver->scan_config;
+	unsigned		generation = 0;
+
+	configure_dsp_thread(&receiver->config);
+	for (;;)
+	{
+		pthread_mutex_lock(&pc->receiver_lock);
+		while (generation == pc->scan_generation && !pc->receivers_stop)
+			pthread_cond_wait(&pc->receiver_wake, &pc->receiver_lock);
+		generation = pc->scan_generation;
+		pthread_mutex_unlock(&pc->receiver_lock);
+		if (pc->receivers_stop)
+			break;
+
+		receiver->ok = scan(&receiver->config);
+
+		pthread_mutex_lock(&pc->receiver_lock);
+		pc->receivers_finished++;
+		pthread_cond_broadcast(&pc->receiver_wake);
+		pthread_mutex_unlock(&pc->receiver_lock);
+	}
+	return 0;
+}
+
+// Start every receiver on its share of the scan, then merge their buckets
+bool scan_receivers(ProgramConfiguration* pc)
+{
+	ClockTime	start_time = clock_time();
+	bool		ok = true;
+
+	pthread_mutex_lock(&pc->receiver_lock);
+	pc->receivers_finished = 0;
+	pc->scan_generation++;
+	pthread_cond_broadcast(&pc->receiver_wake);
+	while (pc->receivers_finished < pc->receiver_count)
+		pthread_cond_wait(&pc->receiver_wake, &pc->receiver_lock);
+	pthread_mutex_unlock(&pc->receiver_lock);
+
+	for (int i = 0; i < pc->receiver_count; i++)
+	{
+		ProgramConfiguration*	rc = &pc->receivers[i].config;
+
+		count_span_frames(rc);
+		for (int b = 0; b < pc->power_buckets; b++)
+		{
+			pc->power_accumulation[b] += rc->power_accumulation[b];
+			pc->bucket_frames[b] += rc->bucket_frames[b];
+		}
+		pc->accumulation_count += rc->accumulation_count;
+		clear_accumulation(rc);
+		ok = ok && pc->receivers[i].ok;
+	}
+	if (pc->verbose)
+		fprintf(pc->verbose, "Scanned with %d receivers in %.3fs\n", pc->receiver_count, (clock_time() - start_time) / 1e6);
+	return ok;
+}
+
+void finalise_receivers(ProgramConfiguration* pc)
+{
+	pthread_mutex_lock(&pc->receiver_lock);
+	pc->receivers_stop = true;
+	pthread_cond_broadcast(&pc->receiver_wake);
+	pthread_mutex_unlock(&pc->receiver_lock);
+
+	for (int i = 0; i < pc->receiver_count; i++)
+		if (pc->receivers[i].running)
+			pthread_join(pc->receivers[i].thread, 0);
+
+	// A device's first channel closes the stream the others share, after stopping the thread that fills their rings
+	for (int i = 0; i < pc->receiver_count; i++)
+	{
+		Receiver*	receiver = &pc->receivers[i];
+
+		finalise_configuration(&receiver->config);
+		if (receiver->config.device_lock == &receiver->device_lock)
+			pthread_mutex_destroy(&receiver->device_lock);
+		if (receiver->config.record_base)
+			free((void*)receiver->config.record_base);
+		free((void*)receiver->config.trigger.prefix);
+	}
+	free(pc->receivers);
+	pc->receivers = 0;
+	pc->receiver_count = 0;
+}
+
+// Each receiver records to its own files, numbered after the name given
+char* receiver_path(const char* path, int index)
+{
+	size_t	length = strlen(path) + 16;
+	char*	numbered = (char*)malloc(length);
+
+	snprintf(numbered, length, "%s-%d", path, index);
+	return numbered;
+}
+
+/*
+ * Serve scan requests on a Unix socket, keeping the device open and its stream running between them,
+ * and the FFT planned. Only a change of range or timing replans, and FFTW's wisdom makes that quick.
+ */
+bool serve(ProgramConfiguration* pc)
+{
+#ifdef _WIN32
+	return false;
+#else
+	struct sockaddr_un	address;
+	int		listener = socket(AF_UNIX, SOCK_STREAM, 0);
+	ScanRequest	planned = {pc->start_frequency, pc->end_frequency, pc->frequency_resolution, pc->scan_time};
+
+	memset(&address, 0, sizeof(address));
+	address.sun_family = AF_UNIX;
+	if (strlen(pc->socket_path) >= sizeof(address.sun_path))
+	{
+		fprintf(stderr, "Socket path %s is too long\n", pc->socket_path);
+		return false;
+	}
+	strcpy(address.sun_path, pc->socket_path);
+	unlink(pc->socket_path);		// Left behind by an earlier daemon
+	if (listener < 0
+	 || bind(listener, (struct sockaddr*)&address, sizeof(address)) != 0
+	 || listen(listener, 4) != 0)
+	{
+		fprintf(stderr, "Can't listen on %s: %s\n", pc->socket_path, strerror(errno));
+		if (listener >= 0)
+			close(listener);
+		return false;
+	}
+	fprintf(stderr, "Serving scan requests on %s\n", pc->socket_path);
+	pause_stream(pc);
+
+	while (signals_caught == 0)
+	{
+		int	client = accept(listener, 0, 0);
+
+		if (client < 0)
+		{
+			if (errno == EINTR)	// A signal will be seen by the loop
+				continue;
+			fprintf(stderr, "Can't accept a connection on %s: %s\n", pc->socket_path, strerror(errno));
+			break;
+		}
+		serve_client(pc, &planned, client);
+	}
+	close(listener);
+	unlink(pc->socket_path);
+	return true;
+#endif
+}
+
+/*
+ * Each line from the client is a request of name=value pairs: start, end, resolution, repetitions and time
+ * (seconds per scan). Anything not given is as for the last request, or the command line.
+ * The spectrum from each scan is written back, then "done", or "error" and why.
+ */
+void serve_client(ProgramConfiguration* pc, ScanRequest* planned, int client)
+{
+#ifndef _WIN32
+	FILE*		in = fdopen(client, "r");
+	int		out_fd = dup(client);
+	FILE*		out = out_fd >= 0 ? fdopen(out_fd, "w") : 0;
+	char		request[1024];
+
+	if (!in || !out)
+	{
+		fprintf(stderr, "Can't open the connection: %s\n", strerror(errno));
+		if (in)
+			fclose(in);
+		else
+			close(client);
+		if (out)
+			fclose(out);
+		else if (out_fd >= 0)
+			close(out_fd);
+		return;
+	}
+	while (signals_caught == 0 && fgets(request, sizeof(request), in))
+	{
+		bool	ok;
+
+		if (resume_stream(pc))
+			ok = serve_request(pc, planned, request, out);
+		else
+			ok = fprintf(out, "error: can't restart the stream\n") >= 0;
+		pause_stream(pc);
+		if (!ok)
+			break;
+		fflush(out);
+	}
+	fclose(in);
+	fclose(out);
+#endif
+}
+
+/*
+ * Between requests the stream is stopped, so nothing overflows or overruns while no scan is running.
+ * Driver buffers still in the ring are given back, and problems are counted afresh from the next request.
+ * A daemon has one device and no receivers; initialise_configuration() refuses anything more.
+ * Only replaying or synthesising has no stream to stop.
+ */
+void pause_stream(ProgramConfiguration* pc)
+{
+	SampleRing*	ring = &pc->ring;
+
+	assert(!pc->receivers);
+	if (pc->replay_path || pc->synthesise_spec)
+		return;
+	stop_acquisition(pc);
+	if (ring->held)
+		release_block(pc);
+	for (; ring->tail != ring->head; ring->tail++)
+		release_direct_buffer(pc, &ring->blocks[ring->tail & (ring->size-1)]);
+	SoapySDRDevice_deactivateStream(pc->device, pc->stream, 0, 0);
+}
+
+bool resume_stream(ProgramConfiguration* pc)
+{
+	SampleRing*	ring = &pc->ring;
+
+	assert(!pc->receivers);
+	if (pc->replay_path || pc->synthesise_spec)
+		return true;
+	if (!pc->device)
+	{
+		fprintf(stderr, "Can't restart the stream: no device\n");
+		return false;
+	}
+	ring->overflows = ring->timeouts = ring->preemptions = ring->preempted_drops = 0;
+	ring->dropped = 0;
+	ring->overruns = 0;
+	ring->blocks_received = 0;
+	ring->high_water = 0;
+	pc->next_sample_time = 0;	// The pause isn't lost samples
+	pc->current_frequency = 0;	// Nothing left of the last tuning to finish
+
+	// In burst mode, each retune activates the stream for one dwell
+	if (!pc->burst_mode && SoapySDRDevice_activateStream(pc->device, pc->stream, 0, 0, 0) != 0)
+	{
+		fprintf(stderr, "Can't restart the stream: %s\n", SoapySDRDevice_lastError());
+		return false;
+	}
+	return start_acquisition(pc);
+}
+
+// Run one request. Returns false if the client has gone away
+bool serve_request(ProgramConfiguration* pc, ScanRequest* planned, char* request, FILE* out)
+{
+	ScanRequest	wanted = *planned;
+	int		repetitions = 1;
+	char*		save = 0;
+
+	for (char* item = strtok_r(request, " \t\r\n", &save); item; item = strtok_r(0, " \t\r\n", &save))
+	{
+		char*	value = strchr(item, '=');
+
+		if (value)
+			*value++ = '\0';
+		if (!value || !*value)
+			return fprintf(out, "error: %s needs a value\n", item) >= 0;
+		else if (strcmp(item, "start") == 0)
+			wanted.start_frequency = frequency_from_str(value);
+		else if (strcmp(item, "end") == 0)
+			wanted.end_frequency = frequency_from_str(value);
+		else if (strcmp(item, "resolution") == 0)
+			wanted.frequency_resolution = frequency_from_str(value);
+		else if (strcmp(item, "repetitions") == 0)
+			repetitions = atoi(value);
+		else if (strcmp(item, "time") == 0)
+			wanted.scan_time = atoi(value);
+		else
+			return fprintf(out, "error: unknown parameter %s\n", item) >= 0;
+	}
+	if (wanted.start_frequency <= 0 || wanted.end_frequency <= wanted.start_frequency || repetitions < 1 || wanted.scan_time < 1)
+		return fprintf(out, "error: invalid scan request\n") >= 0;
+
+	if (wanted.start_frequency != planned->start_frequency
+	 || wanted.end_frequency != planned->end_frequency
+	 || wanted.frequency_resolution != planned->frequency_resolution
+	 || wanted.scan_time != planned->scan_time)
+	{
+		*planned = wanted;
+		pc->start_frequency = wanted.start_frequency;
+		pc->end_frequency = wanted.end_frequency;
+		pc->frequency_resolution = wanted.frequency_resolution;
+		pc->scan_time = wanted.scan_time;
+		if (!replan(pc))
+		{
+			memset(planned, 0, sizeof(*planned));	// Whatever comes next must replan
+			return fprintf(out, "error: can't plan that scan\n") >= 0;
+		}
+	}
+	else if (!pc->fftw_plan)
+		return fprintf(out, "error: no scan is planned\n") >= 0;
+
+	for (int repetition = 0; repetition < repetitions && signals_caught == 0; repetition++)
+	{
+		clear_accumulation(pc);
+		if (!scan(pc))
+			return fprintf(out, "error: scan failed\n") >= 0;
+		fprintf(out, "scan %d of %d\n", repetition+1, repetitions);
+		write_spectrum(pc, out);
+		if (fflush(out) != 0)
+			return false;
+	}
+	return fprintf(out, "done\n") >= 0;
+}
+
+// Plan the scan again for a new range or timing, keeping the device and stream
+bool replan(ProgramConfiguration* pc)
+{
+	if (!plan_frequencies(pc))
+		return false;
+
+	// The sample ring is in the arena. Give back any driver buffers its blocks hold
+	stop_acquisition(pc);
+	if (pc->ring.held)
+		release_block(pc);
+	for (SampleRing* ring = &pc->ring; ring->tail != ring->head; ring->tail++)
+		release_direct_buffer(pc, &ring->blocks[ring->tail & (ring->size-1)]);
+	if (pc->fftw_plan)
+	{
+		fftwf_destroy_plan(pc->fftw_plan);
+		pc->fftw_plan = 0;
+	}
+	if (pc->fftw_frame_plan)
+	{
+		fftwf_destroy_plan(pc->fftw_frame_plan);
+		pc->fftw_frame_plan = 0;
+	}
+	arena_destroy(&pc->arena);
+
+	plan_tuning(pc);
+	pc->current_frequency = 0;	// Nothing left of the last tuning to finish
+	pc->synthesiser.noise_amplitude = 0;	// The noise level is worked out again
+	if (!plan_fft(pc))
+		return false;
+	return !pc->device || start_acquisition(pc);
+}
+
+void clear_accumulation(ProgramConfiguration* pc)
+{
+	memset(pc->power_accumulation, 0, sizeof(float) * pc->power_buckets);
+	memset(pc->bucket_frames, 0, sizeof(int) * pc->power_buckets);
+	pc->accumulation_count = 0;
+	pc->span_frames = 0;
+}
+
+// Add the frames accumulated since the tuning changed to the count for each bucket they covered
+void count_span_frames(ProgramConfiguration* pc)
+{
+	for (int b = pc->span_bin; pc->span_frames && b < pc->span_bin + pc->span_bins; b++)
+		pc->bucket_frames[b] += pc->span_frames;
+	pc->span_frames = 0;
+}
+
+// Write each bucket's frequency and mean level in dBFS, skipping any that weren't scanned
+void write_spectrum(ProgramConfiguration* pc, FILE* fp)
+{
+	double		gain = window_gain(pc);
+	double		full_scale = gain * gain;	// Power of a full-scale tone
+
+	count_span_frames(pc);
+	for (int b = 0; b < pc->power_buckets; b++)
+		if (pc->bucket_frames[b] > 0)
+			fprintf(fp, "%" PRId64 "\t%.2f\n",
+				pc->start_frequency + b * pc->frequency_resolution,
+				10 * log10(pc->power_accumulation[b] / pc->bucket_frames[b] / full_scale + 1e-20));
+}
+
+// A full-scale tone in one bin has the magnitude of the sum of the window
+double window_gain(ProgramConfiguration* pc)
+{
+	double		gain = 0;
+
+	for (int s = 0; s < pc->fft_size; s++)
+		gain += pc->window[s];
+	return gain;
+}
+
+void process_buffer(ProgramConfiguration* pc, const void* iq, int samples)
+{
+	if (pc->triggered)
+		keep_history(pc, iq, samples);
+
+	int	bytes = pc->stream_format->bytes;
+
+	while (samples > 0)
+	{
+		// Convert as much as will fit in this FFT frame
+		int	run = pc->fft_size - pc->fft_fill;
+		if (run > samples)
+			run = samples;
+		if (pc->triggered)
+			pc->trigger.processed += run;
+
+		// Normalise samples to 0..1, multiplied by the window function.
+		// Overlapping frames each window the same samples differently, so are only converted when whole.
+		if (pc->frame_samples)
+			memcpy(pc->frame_samples + pc->fft_fill * bytes, iq, (size_t)run * bytes);
+		else
+			pc->convert(iq, (float*)(pc->fftw_in + pc->batch_fill*pc->fft_size + pc->fft_fill), pc->window_iq + 2*pc->fft_fill, run);
+		iq = (const char*)iq + run * bytes;
+		samples -= run;
+		if ((pc->fft_fill += run) >= pc->fft_size)
+		{
+			pc->fft_fill = 0;
+			if (pc->frame_samples)
+			{		// Slide the overlap down to start the next frame
+				pc->convert(pc->frame_samples, (float*)(pc->fftw_in + pc->batch_fill*pc->fft_size), pc->window_iq, pc->fft_size);
+				pc->fft_fill = pc->fft_size - pc->frame_hop;
+				memmove(pc->frame_samples, pc->frame_samples + pc->frame_hop * bytes, (size_t)pc->fft_fill * bytes);
+			}
+			if (++pc->batch_fill == pc->fft_batch)
+				transform_frames(pc);
+		}
+	}
+}
+
+/*
+ * Transform the whole frames gathered in fftw_in, and accumulate them. A full batch takes one call to FFTW.
+ * A tuning's last frames are usually a partial batch, transformed one at a time before the frequency changes.
+ */
+void transform_frames(ProgramConfiguration* pc)
+{
+	if (pc->batch_fill == pc->fft_batch)
+		fftwf_execute(pc->fftw_plan);
+	else
+		for (int f = 0; f < pc->batch_fill; f++)
+			fftwf_execute_dft(pc->fftw_frame_plan, pc->fftw_in + f*pc->fft_size, pc->fftw_out + f*pc->fft_size);
+	if (pc->batch_fill > 0)
+		handle_fft_out(pc, pc->batch_fill);
+	pc->batch_fill = 0;
+}
+
+/*
+ * Conversion kernels for each stream format we can receive natively.
+ * Each I and Q value is converted and multiplied by its window value, so the compiler can vectorise these.
+ */
+void convert_cs8(const void* iq, float* out, const float* window, int samples)
+{
+	const int8_t*	in = (const int8_t*)iq;
+
+	for (int v = 0; v < 2*samples; v++)
+		out[v] = in[v] * window[v];
+}
+
+void convert_cu8(const void* iq, float* out, const float* window, int samples)
+{
+	const uint8_t*	in = (const uint8_t*)iq;
+
+	for (int v = 0; v < 2*samples; v++)
+		out[v] = (in[v] - 128) * window[v];
+}
+
+// Each pair is packed in three bytes, I in the low 12 bits
+void convert_cs12(const void* iq, float* out, const float* window, int samples)
+{
+	const uint8_t*	in = (const uint8_t*)iq;
+
+	for (int s = 0; s < samples; s++, in += 3)
+	{
+		int16_t	i = (int16_t)((in[1] << 12) | (in[0] << 4)) >> 4;
+		int16_t	q = (int16_t)((in[2] << 8) | (in[1] & 0xF0)) >> 4;
+		out[2*s] = i * window[2*s];
+		out[2*s+1] = q * window[2*s+1];
+	}
+}
+
+void convert_cs16(const void* iq, float* out, const float* window, int samples)
+{
+	const int16_t*	in = (const int16_t*)iq;
+
+	for (int v = 0; v < 2*samples; v++)
+		out[v] = in[v] * window[v];
+}
+
+void convert_cf32(const void* iq, float* out, const float* window, int samples)
+{
+	const float*	in = (const float*)iq;
+
+	for (int v = 0; v < 2*samples; v++)
+		out[v] = in[v] * window[v];
+}
+
+void squared_magnitude(const fftwf_complex* bins, float* out, int count)
+{
+	const float*	in = (const float*)bins;
+
+	for (int b = 0; b < count; b++)
+		out[b] = in[2*b]*in[2*b] + in[2*b+1]*in[2*b+1];
+}
+
+void accumulate(float* accumulation, const float* power, int count)
+{
+	for (int b = 0; b < count; b++)
+		accumulation[b] += power[b];
+}
+
+/*
+ * Vector kernels work on whole registers of values, widening integer samples to 32 bits and then to float.
+ * Any remainder is left to the plain kernel.
+ */
+#if defined(X86_KERNELS)
+bool cpu_has_avx2(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx2");
+}
+
+bool cpu_has_avx512(void)
+{
+	__builtin_cpu_init();
+	return __builtin_cpu_supports("avx512f");
+}
+
+TARGET_AVX2 void convert_cs8_avx2(const void* iq, float* out, const float* window, int samples)
+{
+	const int8_t*	in = (const int8_t*)iq;
+	int		v = 0;
+
+	for (; v + 16 <= 2*samples; v += 16)
+	{
+		__m128i	raw = _mm_loadu_si128((const __m128i*)(in + v));
+		__m256	low = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(raw));
+		__m256	high = _mm256_cvtepi32_ps(_mm256_cvtepi8_epi32(_mm_srli_si128(raw, 8)));
+
+		_mm256_storeu_ps(out + v, _mm256_mul_ps(low, _mm256_loadu_ps(window + v)));
+		_mm256_storeu_ps(out + v + 8, _mm256_mul_ps(high, _mm256_loadu_ps(window + v + 8)));
+	}
+	convert_cs8(in + v, out + v, window + v, samples - v/2);
+}
+
+TARGET_AVX2 void convert_cu8_avx2(const void* iq, float* out, const float* window, int samples)
+{
+	const uint8_t*	in = (const uint8_t*)iq;
+	const __m256i	offset = _mm256_set1_epi32(128);
+	int		v = 0;
+
+	for (; v + 16 <= 2*samples; v += 16)
+	{
+		__m128i	raw = _mm_loadu_si128((const __m128i*)(in + v));
+		__m256	low = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_cvtepu8_epi32(raw), offset));
+		__m256	high = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_cvtepu8_epi32(_mm_srli_si128(raw, 8)), offset));
+
+		_mm256_storeu_ps(out + v, _mm256_mul_ps(low, _mm256_loadu_ps(window + v)));
+		_mm256_storeu_ps(out + v + 8, _mm256_mul_ps(high, _mm256_loadu_ps(window + v + 8)));
+	}
+	convert_cu8(in + v, out + v, window + v, samples - v/2);
+}
+
+TARGET_AVX2 void convert_cs16_avx2(const void* iq, float* out, const float* window, int samples)
+{
+	const int16_t*	in = (const int16_t*)iq;
+	int		v = 0;
+
+	for (; v + 16 <= 2*samples; v += 16)
+	{
+		__m256i	raw = _mm256_loadu_si256((const __m256i*)(in + v));
+		__m256	low = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_castsi256_si128(raw)));
+		__m256	high = _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm256_extracti128_si256(raw, 1)));
+
+		_mm256_storeu_ps(out + v, _mm256_mul_ps(low, _mm256_loadu_ps(window + v)));
+		_mm256_storeu_ps(out + v + 8, _mm256_mul_ps(high, _mm256_loadu_ps(window + v + 8)));
+	}
+	convert_cs16(in + v, out + v, window + v, samples - v/2);
+}
+
+TARGET_AVX2 void convert_cf32_avx2(const void* iq, float* out, const float* window, int samples)
+{
+	const float*	in = (const float*)iq;
+	int		v = 0;
+
+	for (; v + 8 <= 2*samples; v += 8)
+		_mm256_storeu_ps(out + v, _mm256_mul_ps(_mm256_loadu_ps(in + v), _mm256_loadu_ps(window + v)));
+	convert_cf32(in + v, out + v, window + v, samples - v/2);
+}
+
+// Squares eight bins, adds I and Q pairwise, then puts the 64-bit halves of each lane back in order
+TARGET_AVX2 void squared_magnitude_avx2(const fftwf_complex* bins, float* out, int count)
+{
+	const float*	in = (const float*)bins;
+	int		b = 0;
+
+	for (; b + 8 <= count; b += 8)
+	{
+		__m256	low = _mm256_loadu_ps(in + 2*b);
+		__m256	high = _mm256_loadu_ps(in + 2*b + 8);
+		__m256	sums = _mm256_hadd_ps(_mm256_mul_ps(low, low), _mm256_mul_ps(high, high));
+
+		sums = _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(sums), _MM_SHUFFLE(3,1,2,0)));
+		_mm256_storeu_ps(out + b, sums);
+	}
+	squared_magnitude(bins + b, out + b, count - b);
+}
+
+TARGET_AVX2 void accumulate_avx2(float* accumulation, const float* power, int count)
+{
+	int		b = 0;
+
+	for (; b + 8 <= count; b += 8)
+		_mm256_storeu_ps(accumulation + b, _mm256_add_ps(_mm256_loadu_ps(accumulation + b), _mm256_loadu_ps(power + b)));
+	accumulate(accumulation + b, power + b, count - b);
+}
+
+TARGET_AVX512 void convert_cs8_avx512(const void* iq, float* out, const float* window, int samples)
+{
+	const int8_t*	in = (const int8_t*)iq;
+	int		v = 0;
+
+	for (; v + 32 <= 2*samples; v += 32)
+	{
+		__m256i	raw = _mm256_loadu_si256((const __m256i*)(in + v));
+		__m512	low = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm256_castsi256_si128(raw)));
+		__m512	high = _mm512_cvtepi32_ps(_mm512_cvtepi8_epi32(_mm256_extracti128_si256(raw, 1)));
+
+		_mm512_storeu_ps(out + v, _mm512_mul_ps(low, _mm512_loadu_ps(window + v)));
+		_mm512_storeu_ps(out + v + 16, _mm512_mul_ps(high, _mm512_loadu_ps(window + v + 16)));
+	}
+	convert_cs8(in + v, out + v, window + v, samples - v/2);
+}
+
+TARGET_AVX512 void convert_cu8_avx512(const void* iq, float* out, const float* window, int samples)
+{
+	const uint8_t*	in = (const uint8_t*)iq;
+	const __m512i	offset = _mm512_set1_epi32(128);
+	int		v = 0;
+
+	for (; v + 32 <= 2*samples; v += 32)
+	{
+		__m256i	raw = _mm256_loadu_si256((const __m256i*)(in + v));
+		__m512	low = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_cvtepu8_epi32(_mm256_castsi256_si128(raw)), offset));
+		__m512	high = _mm512_cvtepi32_ps(_mm512_sub_epi32(_mm512_cvtepu8_epi32(_mm256_extracti128_si256(raw, 1)), offset));
+
+		_mm512_storeu_ps(out + v, _mm512_mul_ps(low, _mm512_loadu_ps(window + v)));
+		_mm512_storeu_ps(out + v + 16, _mm512_mul_ps(high, _mm512_loadu_ps(window + v + 16)));
+	}
+	convert_cu8(in + v, out + v, window + v, samples - v/2);
+}
+
+TARGET_AVX512 void convert_cs16_avx512(const void* iq, float* out, const float* window, int samples)
+{
+	const int16_t*	in = (const int16_t*)iq;
+	int		v = 0;
+
+	for (; v + 32 <= 2*samples; v += 32)
+	{
+		__m512i	raw = _mm512_loadu_si512((const void*)(in + v));
+		__m512	low = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm512_castsi512_si256(raw)));
+		__m512	high = _mm512_cvtepi32_ps(_mm512_cvtepi16_epi32(_mm512_extracti64x4_epi64(raw, 1)));
+
+		_mm512_storeu_ps(out + v, _mm512_mul_ps(low, _mm512_loadu_ps(window + v)));
+		_mm512_storeu_ps(out + v + 16, _mm512_mul_ps(high, _mm512_loadu_ps(window + v + 16)));
+	}
+	convert_cs16(in + v, out + v, window + v, samples - v/2);
+}
+
+TARGET_AVX512 void convert_cf32_avx512(const void* iq, float* out, const float* window, int samples)
+{
+	const float*	in = (const float*)iq;
+	int		v = 0;
+
+	for (; v + 16 <= 2*samples; v += 16)
+		_mm512_storeu_ps(out + v, _mm512_mul_ps(_mm512_loadu_ps(in + v), _mm512_loadu_ps(window + v)));
+	convert_cf32(in + v, out + v, window + v, samples - v/2);
+}
+
+// Gathers the I and Q of sixteen bins into separate registers
+TARGET_AVX512 void squared_magnitude_avx512(const fftwf_complex* bins, float* out, int count)
+{
+	const float*	in = (const float*)bins;
+	const __m512i	even = _mm512_setr_epi32(0, 2, 4, 6, 8, 10, 12, 14, 16, 18, 20, 22, 24, 26, 28, 30);
+	const __m512i	odd = _mm512_setr_epi32(1, 3, 5, 7, 9, 11, 13, 15, 17, 19, 21, 23, 25, 27, 29, 31);
+	int		b = 0;
+
+	for (; b + 16 <= count; b += 16)
+	{
+		__m512	low = _mm512_loadu_ps(in + 2*b);
+		__m512	high = _mm512_loadu_ps(in + 2*b + 16);
+		__m512	i = _mm512_permutex2var_ps(low, even, high);
+		__m512	q = _mm512_permutex2var_ps(low, odd, high);
+
+		_mm512_storeu_ps(out + b, _mm512_fmadd_ps(i, i, _mm512_mul_ps(q, q)));
+	}
+	squared_magnitude(bins + b, out + b, count - b);
+}
+
+TARGET_AVX512 void accumulate_avx512(float* accumulation, const float* power, int count)
+{
+	int		b = 0;
+
+	for (; b + 16 <= count; b += 16)
+		_mm512_storeu_ps(accumulation + b, _mm512_add_ps(_mm512_loadu_ps(accumulation + b), _mm512_loadu_ps(power + b)));
+	accumulate(accumulation + b, power + b, count - b);
+}
+#endif
+
+#if defined(NEON_KERNELS)
+void convert_cs8_neon(const void* iq, float* out, const float* window, int samples)
+{
+	const int8_t*	in = (const int8_t*)iq;
+	int		v = 0;
+
+	for (; v + 16 <= 2*samples; v += 16)
+	{
+		int8x16_t	raw = vld1q_s8(in + v);
+		int16x8_t	low = vmovl_s8(vget_low_s8(raw));
+		int16x8_t	high = vmovl_s8(vget_high_s8(raw));
+
+		vst1q_f32(out + v, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(low))), vld1q_f32(window + v)));
+		vst1q_f32(out + v + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(low))), vld1q_f32(window + v + 4)));
+		vst1q_f32(out + v + 8, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(high))), vld1q_f32(window + v + 8)));
+		vst1q_f32(out + v + 12, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(high))), vld1q_f32(window + v + 12)));
+	}
+	convert_cs8(in + v, out + v, window + v, samples - v/2);
+}
+
+void convert_cu8_neon(const void* iq, float* out, const float* window, int samples)
+{
+	const uint8_t*	in = (const uint8_t*)iq;
+	const int16x8_t	offset = vdupq_n_s16(128);
+	int		v = 0;
+
+	for (; v + 16 <= 2*samples; v += 16)
+	{
+		uint8x16_t	raw = vld1q_u8(in + v);
+		int16x8_t	low = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_low_u8(raw))), offset);
+		int16x8_t	high = vsubq_s16(vreinterpretq_s16_u16(vmovl_u8(vget_high_u8(raw))), offset);
+
+		vst1q_f32(out + v, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(low))), vld1q_f32(window + v)));
+		vst1q_f32(out + v + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(low))), vld1q_f32(window + v + 4)));
+		vst1q_f32(out + v + 8, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(high))), vld1q_f32(window + v + 8)));
+		vst1q_f32(out + v + 12, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(high))), vld1q_f32(window + v + 12)));
+	}
+	convert_cu8(in + v, out + v, window + v, samples - v/2);
+}
+
+void convert_cs16_neon(const void* iq, float* out, const float* window, int samples)
+{
+	const int16_t*	in = (const int16_t*)iq;
+	int		v = 0;
+
+	for (; v + 8 <= 2*samples; v += 8)
+	{
+		int16x8_t	raw = vld1q_s16(in + v);
+
+		vst1q_f32(out + v, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(raw))), vld1q_f32(window + v)));
+		vst1q_f32(out + v + 4, vmulq_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(raw))), vld1q_f32(window + v + 4)));
+	}
+	convert_cs16(in + v, out + v, window + v, samples - v/2);
+}
+
+void convert_cf32_neon(const void* iq, float* out, const float* window, int samples)
+{
+	const float*	in = (const float*)iq;
+	int		v = 0;
+
+	for (; v + 4 <= 2*samples; v += 4)
+		vst1q_f32(out + v, vmulq_f32(vld1q_f32(in + v), vld1q_f32(window + v)));
+	convert_cf32(in + v, out + v, window + v, samples - v/2);
+}
+
+// vld2q separates I and Q
+void squared_magnitude_neon(const fftwf_complex* bins, float* out, int count)
+{
+	const float*	in = (const float*)bins;
+	int		b = 0;
+
+	for (; b + 4 <= count; b += 4)
+	{
+		float32x4x2_t	iq = vld2q_f32(in + 2*b);
+
+		vst1q_f32(out + b, vmlaq_f32(vmulq_f32(iq.val[0], iq.val[0]), iq.val[1], iq.val[1]));
+	}
+	squared_magnitude(bins + b, out + b, count - b);
+}
+
+void accumulate_neon(float* accumulation, const float* power, int count)
+{
+	int		b = 0;
+
+	for (; b + 4 <= count; b += 4)
+		vst1q_f32(accumulation + b, vaddq_f32(vld1q_f32(accumulation + b), vld1q_f32(power + b)));
+	accumulate(accumulation + b, power + b, count - b);
+}
+#endif
+
+/*
+ * Kernel sets, best first. The first the CPU supports is used unless another is asked for.
+ */
+const KernelSet	kernel_sets[] =
+{
+#if defined(X86_KERNELS)
+	{ "avx512",	cpu_has_avx512,	convert_cs8_avx512,	convert_cu8_avx512,	convert_cs16_avx512,	convert_cf32_avx512,	squared_magnitude_avx512,	accumulate_avx512 },
+	{ "avx2",	cpu_has_avx2,	convert_cs8_avx2,	convert_cu8_avx2,	convert_cs16_avx2,	convert_cf32_avx2,	squared_magnitude_avx2,		accumulate_avx2 },
+#endif
+#if defined(NEON_KERNELS)
+	{ "neon",	0,		convert_cs8_neon,	convert_cu8_neon,	convert_cs16_neon,	convert_cf32_neon,	squared_magnitude_neon,		accumulate_neon },
+#endif
+	{ "plain",	0,		0,			0,			0,			0,			squared_magnitude,		accumulate },
+};
+
+bool select_kernels(ProgramConfiguration* pc)
+{
+	int	count = sizeof(kernel_sets)/sizeof(kernel_sets[0]);
+
+	for (int i = 0; i < count && !pc->kernels; i++)
+	{
+		const KernelSet*	kernels = &kernel_sets[i];
+
+		if (pc->kernel_name && strcmp(pc->kernel_name, kernels->name) != 0)
+			continue;
+		if (kernels->supported && !kernels->supported())
+		{
+			if (pc->kernel_name)
+			{
+				fprintf(stderr, "This CPU can't run the %s kernels\n", kernels->name);
+				return false;
+			}
+			continue;
+		}
+		pc->kernels = kernels;
+	}
+
+	if (!pc->kernels)
+	{
+		fprintf(stderr, "No %s kernels, choose from:", pc->kernel_name);
+		for (int i = 0; i < count; i++)
+			fprintf(stderr, " %s", kernel_sets[i].name);
+		fprintf(stderr, "\n");
+		return false;
+	}
+	if (pc->verbose)
+		fprintf(pc->verbose, "Using %s DSP kernels%s\n", pc->kernels->name, pc->kernel_name ? " as asked" : "");
+	return true;
+}
+
+SampleConverter format_converter(const KernelSet* kernels, const StreamFormat* format)
+{
+	SampleConverter	convert = 0;
+
+	if (strcmp(format->name, SOAPY_SDR_CS8) == 0)
+		convert = kernels->convert_cs8;
+	else if (strcmp(format->name, SOAPY_SDR_CU8) == 0)
+		convert = kernels->convert_cu8;
+	else if (strcmp(format->name, SOAPY_SDR_CS16) == 0)
+		convert = kernels->convert_cs16;
+	else if (strcmp(format->name, SOAPY_SDR_CF32) == 0)
+		convert = kernels->convert_cf32;
+	return convert ? convert : format->convert;
+}
+
+const StreamFormat	stream_formats[] =
+{
+	{ SOAPY_SDR_CS8,	2,	128,		convert_cs8,	"ci8" },
+	{ SOAPY_SDR_CU8,	2,	128,		convert_cu8,	"cu8" },
+	{ SOAPY_SDR_CS12,	3,	2048,		convert_cs12,	0 },
+	{ SOAPY_SDR_CS16,	4,	32768,		convert_cs16,	"ci16_le" },
+	{ SOAPY_SDR_CF32,	8,	1,		convert_cf32,	"cf32_le" },
+};
+
+const StreamFormat* find_stream_format(const char* name)
+{
+	for (int i = 0; name && i < sizeof(stream_formats)/sizeof(stream_formats[0]); i++)
+		if (strcmp(stream_formats[i].name, name) == 0)
+			return &stream_formats[i];
+	return 0;
+}
+
+void	handle_fft_out(ProgramConfiguration* pc, int frames)
+{
+	Frequency	lowest_frequency_retained = (pc->current_frequency-pc->tuning_bandwidth/2);
+	int		lowest_bin = (lowest_frequency_retained - pc->start_frequency)/pc->frequency_resolution;
+	int		bin_count = pc->tuning_bandwidth/pc->frequency_resolution;
+
+	// Only accumulate the bins within the scan. The last tuning usually runs past the end
+	int		first_bin = lowest_bin < 0 ? -lowest_bin : 0;
+	int		last_bin = lowest_bin+bin_count > pc->power_buckets ? pc->power_buckets - lowest_bin : bin_count;
+	if (first_bin >= last_bin)
+		return;	// Sometimes happens on interrupt
+
+	int		below_centre = bin_count/2;
+	for (int f = 0; f < frames; f++)
+	{
+		const fftwf_complex*	out = pc->fftw_out + f*pc->fft_size;
+		float*			power = pc->fft_power + f*pc->fft_size;
+
+		// fftw_out[0] is DC, then center to max-freq, then min-freq back to centre.
+		// Re-order the retained bins from min-freq to max-freq:
+		pc->kernels->squared_magnitude(out + pc->fft_size - below_centre, power, below_centre);
+		pc->kernels->squared_magnitude(out, power + below_centre, bin_count - below_centre);
+
+		if (pc->triggered)
+		{
+			int	peak_bin = 0;
+			for (int s = 1; s < bin_count; s++)
+				if (power[s] > power[peak_bin])
+					peak_bin = s;
+			if (power[peak_bin] >= pc->trigger.power)
+				check_trigger(pc, peak_bin, power[peak_bin]);
+		}
+
+		// Sum the batch into the first frame, so the scan is accumulated once
+		if (f > 0)
+			pc->kernels->accumulate(pc->fft_power + first_bin, power + first_bin, last_bin - first_bin);
+	}
+
+	// REVISIT: Accumulate bin power variance?
+
+	// Summarise into 80 bins for terminal output:
+	if (0)
+	{
+		int	width = 79;
+		int	stride = (pc->fft_size-1)/width;
+		for (int s = 0; s < pc->fft_size-stride; s += stride)
+		{
+			float sum = 0;
+			for (int j = 0; j < stride; j++)
+				sum += pc->fft_power[s+j];
+			fprintf(stderr, "%d: %d\n", s/stride, (int)floor(sum/stride));
+		}
+		exit(0);
+	}
+
+	pc->kernels->accumulate(pc->power_accumulation + lowest_bin + first_bin, pc->fft_power + first_bin, last_bin - first_bin);
+	pc->accumulation_count += frames;
+
+	// Count frames per bucket only when the tuning changes:
+	if (lowest_bin+first_bin != pc->span_bin || last_bin-first_bin != pc->span_bins)
+	{
+		count_span_frames(pc);
+		pc->span_bin = lowest_bin+first_bin;
+		pc->span_bins = last_bin-first_bin;
+	}
+	pc->span_frames += frames;
+}
+
+/*
+ * Map a recording for replay. Either a SigMF recording, whose metadata gives the format, sample rate and
+ * the frequency of each capture, or a raw file whose extension gives the format (.cs8, .cu8, .cs12, .cs16, .cf32).
+ * A raw file is taken to be tuned to the start frequency (or the centre, if an end frequency is given).
+ */
+bool open_recording(ProgramConfiguration* pc)
+{
+	Recording*	recording = &pc->recording;
+	const char*	path = pc->replay_path;
+	size_t		path_len = strlen(path);
+	char*		base = (char*)malloc(path_len + sizeof(".sigmf-data"));
+	char*		data_path = (char*)malloc(path_len + sizeof(".sigmf-data"));
+	const char*	extension = strrchr(path, '.');
+	bool		ok = false;
+
+	recording->path = path;
+	strcpy(base, path);
+	if (extension && (strcmp(extension, ".sigmf-meta") == 0 || strcmp(extension, ".sigmf-data") == 0 || strcmp(extension, ".sigmf") == 0))
+		base[extension - path] = '\0';
+
+	// Is this a SigMF recording?
+	sprintf(data_path, "%s.sigmf-meta", base);
+#ifndef _WIN32
+	if (access(data_path, R_OK) == 0)
+	{
+		if (!read_sigmf_meta(pc, data_path))
+			goto done;
+		sprintf(data_path, "%s.sigmf-data", base);
+	}
+	else
+#endif
+	{
+		strcpy(data_path, path);
+		if (!extension || !(pc->stream_format = find_stream_format(extension[1] == 'c' ? extension+1 : "")))
+		{
+			// SoapySDR format names are upper case
+			char	format[8] = {0};
+			for (int i = 0; extension && i < sizeof(format)-1 && extension[i+1]; i++)
+				format[i] = toupper(extension[i+1]);
+			if (!(pc->stream_format = find_stream_format(format)))
+			{
+				fprintf(stderr, "Can't tell the sample format of %s\n", path);
+				goto done;
+			}
+		}
+		if (!pc->requested_sample_rate)
+		{
+			fprintf(stderr, "The sample rate of %s must be given with -R\n", path);
+			goto done;
+		}
+		pc->sample_rate = pc->requested_sample_rate;
+	}
+
+	// Captures without a frequency are at the requested frequency:
+	Frequency	frequency = pc->end_frequency > pc->start_frequency ? (pc->start_frequency+pc->end_frequency)/2 : pc->start_frequency;
+	if (!recording->captures)
+	{
+		recording->captures = (Capture*)calloc(1, sizeof(Capture));
+		recording->capture_count = 1;
+	}
+	for (int i = 0; i < recording->capture_count; i++)
+		if (!recording->captures[i].frequency)
+			recording->captures[i].frequency = frequency;
+
+#ifdef _WIN32
+	fprintf(stderr, "Replaying recordings is not supported on Windows\n");
+#else
+	int		fd = open(data_path, O_RDONLY);
+	struct stat	st;
+	void*		data;
+
+	if (fd < 0 || fstat(fd, &st) != 0)
+	{
+		fprintf(stderr, "Can't open recording %s: %s\n", data_path, strerror(errno));
+		if (fd >= 0)
+			close(fd);
+		goto done;
+	}
+	data = st.st_size > 0 ? mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0) : MAP_FAILED;
+	close(fd);
+	if (data == MAP_FAILED)
+	{
+		fprintf(stderr, "Can't map recording %s\n", data_path);
+		goto done;
+	}
+	madvise(data, st.st_size, MADV_SEQUENTIAL);
+	recording->data = data;
+	recording->length = st.st_size;
+	recording->samples = (long)(st.st_size / pc->stream_format->bytes);
+	ok = true;
+#endif
+
+	// Without a frequency range, report everything in the recording:
+	if (ok && pc->start_frequency <= 0)
+	{
+		Frequency	lowest = recording->captures[0].frequency;
+		Frequency	highest = lowest;
+		Frequency	bandwidth = pc->sample_rate * (1 - pc->crop_ratio);
+
+		for (int i = 1; i < recording->capture_count; i++)
+		{
+			if (lowest > recording->captures[i].frequency)
+				lowest = recording->captures[i].frequency;
+			if (highest < recording->captures[i].frequency)
+				highest = recording->captures[i].frequency;
+		}
+		pc->start_frequency = lowest - bandwidth/2;
+		pc->end_frequency = highest + bandwidth/2;
+	}
+
+	pc->native_format = pc->stream_format->name;
+	pc->full_scale = pc->stream_format->full_scale;
+	pc->sample_scale = (float)(1.0 / pc->full_scale);
+	pc->ring_blocks = 0;		// Processed in place, no ring needed
+	if (pc->repetition_limit == 0)
+		pc->repetition_limit = 1;	// A recording doesn't change, so replay it once unless asked
+	if (ok)
+		fprintf(stderr, "Replaying %ld %s samples at %g samples/s from %s in %d capture%s\n",
+			recording->samples, pc->stream_format->name, pc->sample_rate, data_path,
+			recording->capture_count, s_if_plural(recording->capture_count));
+
+done:
+	free(base);
+	free(data_path);
+	return ok;
+}
+
+// Read the SigMF metadata we need: the data type, sample rate and captures
+bool read_sigmf_meta(ProgramConfiguration* pc, const char* meta_path)
+{
+	Recording*	recording = &pc->recording;
+	FILE*		fp = fopen(meta_path, "rb");
+	char*		json = 0;
+	long		length;
+	const char*	end;
+	const char*	value;
+	bool		ok = false;
+
+	if (!fp
+	 || fseek(fp, 0, SEEK_END) != 0
+	 || (length = ftell(fp)) <= 0
+	 || fseek(fp, 0, SEEK_SET) != 0
+	 || !(json = (char*)malloc(length+1))
+	 || fread(json, 1, length, fp) != (size_t)length)
+	{
+		fprintf(stderr, "Can't read SigMF metadata %s\n", meta_path);
+		goto done;
+	}
+	json[length] = '\0';
+	end = json + length;
+
+	if (!(value = json_value(json, end, "core:datatype")))
+	{
+		fprintf(stderr, "%s has no core:datatype\n", meta_path);
+		goto done;
+	}
+	for (int i = 0; *value == '"' && i < sizeof(stream_formats)/sizeof(stream_formats[0]); i++)
+	{
+		const char*	sigmf = stream_formats[i].sigmf;
+		if (sigmf && strncmp(value+1, sigmf, strlen(sigmf)) == 0 && value[strlen(sigmf)+1] == '"')
+			pc->stream_format = &stream_formats[i];
+	}
+	if (!pc->stream_format)
+	{
+		fprintf(stderr, "%s has an unsupported core:datatype %.12s\n", meta_path, value);
+		goto done;
+	}
+
+	pc->sample_rate = pc->requested_sample_rate;
+	if ((value = json_value(json, end, "core:sample_rate")) != 0)
+		pc->sample_rate = strtod(value, 0);
+	if (pc->sample_rate <= 0)
+	{
+		fprintf(stderr, "%s has no core:sample_rate, use -R\n", meta_path);
+		goto done;
+	}
+
+	// Each capture segment starts at a sample number, and may give the frequency:
+	if ((value = json_value(json, end, "captures")) != 0 && *value == '[')
+	{
+		const char*	array_end = json_close(value, end);
+		const char*	p = value+1;
+
+		while ((p = memchr(p, '{', array_end - p)) != 0)
+		{
+			const char*	capture_end = json_close(p, array_end);
+			const char*	v;
+			Capture*	capture;
+
+			recording->captures = (Capture*)realloc(recording->captures, sizeof(Capture) * (recording->capture_count+1));
+			capture = &recording->captures[recording->capture_count++];
+			capture->sample_start = (v = json_value(p, capture_end, "core:sample_start")) ? atol(v) : 0;
+			capture->frequency = (v = json_value(p, capture_end, "core:frequency")) ? (Frequency)strtod(v, 0) : 0;
+			capture->time = (v = json_value(p, capture_end, "core:datetime")) ? json_datetime(v) : 0;
+			capture->hardware_time = (v = json_value(p, capture_end, "powerscan:hardware_time")) ? atoll(v) : 0;
+			p = capture_end;
+		}
+	}
+	ok = true;
+
+done:
+	if (fp)
+		fclose(fp);
+	free(json);
+	return ok;
+}
+
+// Find a key in this JSON text, and return where its value starts
+const char* json_value(const char* json, const char* end, const char* key)
+{
+	size_t		key_len = strlen(key);
+
+	for (const char* p = json; (p = memchr(p, '"', end - p)) != 0; p++)
+	{
+		if (p + key_len + 2 > end || strncmp(p+1, key, key_len) != 0 || p[key_len+1] != '"')
+			continue;
+		for (p += key_len+2; p < end && isspace(*p); p++)
+			;
+		if (p < end && *p == ':')
+		{
+			for (p++; p < end && isspace(*p); p++)
+				;
+			return p;
+		}
+	}
+	return 0;
+}
+
+// Find the end of the JSON object or array that starts here
+const char* json_close(const char* json, const char* end)
+{
+	int		depth = 0;
+	bool		in_string = false;
+
+	for (const char* p = json; p < end; p++)
+	{
+		if (in_string)
+		{
+			if (*p == '\\')
+				p++;
+			else if (*p == '"')
+				in_string = false;
+		}
+		else if (*p == '"')
+			in_string = true;
+		else if (*p == '{' || *p == '[')
+			depth++;
+		else if ((*p == '}' || *p == ']') && --depth == 0)
+			return p+1;
+	}
+	return end;
+}
+
+// Convert a SigMF "YYYY-MM-DDTHH:MM:SS.ffffffZ" datetime string to a time, or 0 if it isn't one
+ClockTime json_datetime(const char* value)
+{
+	struct tm	tm = {0};
+	int		consumed = 0;
+	long		microseconds = 0;
+	long		scale = 100000;
+	time_t		seconds;
+
+	if (sscanf(value, "\"%d-%d-%dT%d:%d:%d%n", &tm.tm_year, &tm.tm_mon, &tm.tm_mday, &tm.tm_hour, &tm.tm_min, &tm.tm_sec, &consumed) != 6)
+		return 0;
+	tm.tm_year -= 1900;
+	tm.tm_mon -= 1;
+	if (value[consumed] == '.')
+		for (const char* p = value + consumed + 1; isdigit((unsigned char)*p) && scale > 0; p++, scale /= 10)
+			microseconds += (*p - '0') * scale;
+#ifdef _WIN32
+	seconds = _mkgmtime(&tm);
+#else
+	seconds = timegm(&tm);
+#endif
+	return seconds == (time_t)-1 ? 0 : (ClockTime)seconds * 1000000 + microseconds;
+}
+
+// Process each capture segment in the recording, straight out of the mapped file
+bool replay(ProgramConfiguration* pc)
+{
+	Recording*	recording = &pc->recording;
+	ClockTime	start_time = clock_time();
+	long		samples_replayed = 0;
+
+	start_stream_clock(pc, start_time);
+	for (int i = 0; i < recording->capture_count && signals_caught <= 1; i++)
+	{
+		long		sample = recording->captures[i].sample_start;
+		long		end = i+1 < recording->capture_count ? recording->captures[i+1].sample_start : recording->samples;
+
+		if (end > recording->samples)
+			end = recording->samples;
+		if (recording->captures[i].time)	// Replay the recorded timeline
+			start_stream_clock(pc, recording->captures[i].time);
+		transform_frames(pc);
+		pc->current_frequency = recording->captures[i].frequency;
+		pc->fft_fill = 0;
+		if (pc->verbose)
+			fprintf(pc->verbose, "Replaying %ld samples at %" PRId64 "\n", end - sample, pc->current_frequency);
+
+		while (sample < end && signals_caught <= 1)
+		{
+			int	samples = end - sample > MAX_SAMPLES ? MAX_SAMPLES : (int)(end - sample);
+
+			advance_stream_clock(pc, samples);
+			process_buffer(pc, (const char*)recording->data + sample * pc->stream_format->bytes, samples);
+			sample += samples;
+			samples_replayed += samples;
+		}
+	}
+	transform_frames(pc);
+
+	if (pc->verbose)
+	{
+		double	elapsed = (clock_time() - start_time) / 1e6;
+		fprintf(pc->verbose, "Replayed %ld samples in %.3fs: %.1f Msamples/s, %.1f times real time\n",
+			samples_replayed, elapsed,
+			elapsed > 0 ? samples_replayed / elapsed / 1e6 : 0,
+			elapsed > 0 ? samples_replayed / elapsed / pc->sample_rate : 0);
+	}
+	return true;
+}
+
+void close_recording(Recording* recording)
+{
+#ifndef _WIN32
+	if (recording->data)
+		munmap((void*)recording->data, recording->length);
+#endif
+	free(recording->captures);
+	memset(recording, 0, sizeof(*recording));
+}
+
+/*
+ * Create the SigMF data file and start the writer thread.
+ * The data file is written with O_DIRECT where that's available, so a long recording doesn't flood the page cache.
+ */
+bool start_recorder(ProgramConfiguration* pc)
+{
+	Recorder*	recorder = &pc->recorder;
+	char*		data_path = (char*)malloc(strlen(pc->record_base) + sizeof(".sigmf-data"));
+	int		flags = O_WRONLY | O_CREAT | O_TRUNC;
+
+	recorder->base = pc->record_base;
+	sprintf(data_path, "%s.sigmf-data", recorder->base);
+#ifdef O_DIRECT
+	recorder->fd = open(data_path, flags | O_DIRECT, 0644);
+	recorder->direct = recorder->fd >= 0;
+	if (recorder->fd < 0 && errno == EINVAL)	// Not supported by this filesystem
+#endif
+		recorder->fd = open(data_path, flags, 0644);
+	if (recorder->fd < 0)
+	{
+		fprintf(stderr, "Can't create %s: %s\n", data_path, strerror(errno));
+		free(data_path);
+		return false;
+	}
+
+	recorder->capture_limit = pc->tuning_count + 1;
+	recorder->captures = (Capture*)calloc(recorder->capture_limit, sizeof(Capture));
+	recorder->running = true;
+	if (pthread_create(&recorder->thread, 0, recorder_thread, pc) != 0)
+	{
+		fprintf(stderr, "Can't start the recording thread\n");
+		recorder->running = false;
+		close(recorder->fd);
+		free(data_path);
+		return false;
+	}
+	if (pc->verbose)
+		fprintf(pc->verbose, "Recording %s samples to %s%s\n", pc->stream_format->name, data_path, recorder->direct ? " using direct I/O" : "");
+	free(data_path);
+	return true;
+}
+
+// Write each chunk as the DSP fills it
+void* recorder_thread(void* arg)
+{
+	ProgramConfiguration*	pc = (ProgramConfiguration*)arg;
+	Recorder*	recorder = &pc->recorder;
+
+	for (;;)
+	{
+		unsigned	tail = recorder->tail;
+		unsigned	head = __atomic_load_n(&recorder->head, __ATOMIC_ACQUIRE);
+
+		if (head == tail)
+		{
+			if (__atomic_load_n(&recorder->stop, __ATOMIC_ACQUIRE))
+				break;
+			usleep(RECORD_POLL_USLEEP);
+			continue;
+		}
+
+		const char*	chunk = recorder->chunks + (size_t)(tail % RECORD_CHUNKS) * RECORD_CHUNK_BYTES;
+		size_t		written = 0;
+
+		while (written < RECORD_CHUNK_BYTES)
+		{
+			ssize_t	n = write(recorder->fd, chunk + written, RECORD_CHUNK_BYTES - written);
+			if (n < 0 && errno == EINTR)
+				continue;
+			if (n <= 0)
+			{
+				fprintf(stderr, "Recording stopped, write failed: %s\n", n < 0 ? strerror(errno) : "disk full");
+				__atomic_store_n(&recorder->failed, true, __ATOMIC_RELEASE);
+				return 0;
+			}
+			written += n;
+		}
+		__atomic_store_n(&recorder->tail, tail+1, __ATOMIC_RELEASE);
+	}
+	return 0;
+}
+
+/*
+ * Queue samples for recording, starting a new capture when the frequency changes or samples are missing.
+ * If the writer has fallen behind, the samples are dropped from the recording, not from the scan.
+ */
+void record_samples(ProgramConfiguration* pc, const void* iq, int samples, long long buffer_time, ClockTime receive_time)
+{
+	Recorder*	recorder = &pc->recorder;
+	int		bytes_per_sample = pc->stream_format->bytes;
+	const char*	in = (const char*)iq;
+	size_t		bytes = (size_t)samples * bytes_per_sample;
+
+	if (!recorder->running || samples <= 0 || __atomic_load_n(&recorder->failed, __ATOMIC_ACQUIRE))
+		return;
+
+	Capture*	last = recorder->capture_count ? &recorder->captures[recorder->capture_count-1] : 0;
+	bool		discontinuity = recorder->gap
+				|| !last
+				|| last->frequency != pc->current_frequency
+				|| (buffer_time && recorder->next_time && llabs(buffer_time - recorder->next_time) * pc->sample_rate > 1e9);
+	if (discontinuity)
+	{
+		if (recorder->capture_count == recorder->capture_limit)
+		{
+			recorder->capture_limit *= 2;
+			recorder->captures = (Capture*)realloc(recorder->captures, sizeof(Capture) * recorder->capture_limit);
+		}
+		Capture*	capture = &recorder->captures[recorder->capture_count++];
+		capture->sample_start = recorder->samples;
+		capture->frequency = pc->current_frequency;
+		capture->time = receive_time - (ClockTime)(samples * 1e6 / pc->sample_rate);
+		capture->hardware_time = buffer_time;
+		recorder->gap = false;
+	}
+	recorder->next_time = buffer_time ? buffer_time + (long long)(samples * 1e9 / pc->sample_rate) : 0;
+
+	while (bytes > 0)
+	{
+		unsigned	waiting = recorder->head - __atomic_load_n(&recorder->tail, __ATOMIC_ACQUIRE);
+		if (waiting >= RECORD_CHUNKS)
+		{		// The disk can't keep up
+			recorder->dropped += bytes / bytes_per_sample;
+			recorder->gap = true;
+			return;
+		}
+		if (recorder->high_water < waiting+1)
+			recorder->high_water = waiting+1;
+
+		char*		chunk = recorder->chunks + (size_t)(recorder->head % RECORD_CHUNKS) * RECORD_CHUNK_BYTES;
+		size_t		run = RECORD_CHUNK_BYTES - recorder->fill;
+		if (run > bytes)
+			run = bytes;
+		memcpy(chunk + recorder->fill, in, run);
+		in += run;
+		bytes -= run;
+		recorder->samples += run / bytes_per_sample;
+		if ((recorder->fill += run) == RECORD_CHUNK_BYTES)
+		{
+			recorder->fill = 0;
+			__atomic_store_n(&recorder->head, recorder->head+1, __ATOMIC_RELEASE);
+		}
+	}
+}
+
+// Finish writing the data, then write the metadata that describes it
+void stop_recorder(ProgramConfiguration* pc)
+{
+	Recorder*	recorder = &pc->recorder;
+	char*		meta_path;
+
+	if (!recorder->running)
+		return;
+	__atomic_store_n(&recorder->stop, true, __ATOMIC_RELEASE);
+	pthread_join(recorder->thread, 0);
+	recorder->running = false;
+
+	// The last chunk is partial, so can't be written with O_DIRECT:
+	if (recorder->fill > 0 && !recorder->failed)
+	{
+#ifdef O_DIRECT
+		if (recorder->direct)
+			fcntl(recorder->fd, F_SETFL, fcntl(recorder->fd, F_GETFL) & ~O_DIRECT);
+#endif
+		const char*	chunk = recorder->chunks + (size_t)(recorder->head % RECORD_CHUNKS) * RECORD_CHUNK_BYTES;
+		if (write(recorder->fd, chunk, recorder->fill) != (ssize_t)recorder->fill)
+			fprintf(stderr, "Recording incomplete, write failed: %s\n", strerror(errno));
+	}
+	close(recorder->fd);
+
+	meta_path = (char*)malloc(strlen(recorder->base) + sizeof(".sigmf-meta"));
+	sprintf(meta_path, "%s.sigmf-meta", recorder->base);
+	if (!write_sigmf_meta(pc, meta_path, recorder->captures, recorder->capture_count, 0))
+		fprintf(stderr, "Can't write %s: %s\n", meta_path, strerror(errno));
+	else if (pc->verbose || recorder->dropped)
+		fprintf(stderr, "Recorded %ld samples in %d capture%s to %s.sigmf-data, %ld dropped, high-water %u of %d chunks\n",
+			recorder->samples, recorder->capture_count, s_if_plural(recorder->capture_count), recorder->base,
+			recorder->dropped, recorder->high_water, RECORD_CHUNKS);
+	free(meta_path);
+	free(recorder->captures);
+	recorder->captures = 0;
+}
+
+// Describe the samples with these captures, and optionally one annotation (a JSON object)
+bool write_sigmf_meta(ProgramConfiguration* pc, const char* meta_path, const Capture* captures, int capture_count, const char* annotation)
+{
+	FILE*		fp = fopen(meta_path, "w");
+	char*		driver = pc->device ? SoapySDRDevice_getDriverKey(pc->device) : 0;
+
+	if (!fp)
+		return false;
+	fprintf(fp,
+		"{\n"
+		"  \"global\": {\n"
+		"    \"core:datatype\": \"%s\",\n"
+		"    \"core:sample_rate\": %.17g,\n"
+		"    \"core:version\": \"1.0.0\",\n"
+		"    \"core:recorder\": \"powerscan\",\n",
+		pc->stream_format->sigmf, pc->sample_rate);
+	if (driver)
+		fprintf(fp, "    \"core:hw\": \"%s\",\n", driver);
+	fprintf(fp,
+		"    \"core:extensions\": [ { \"name\": \"powerscan\", \"version\": \"1.0.0\", \"optional\": true } ]\n"
+		"  },\n"
+		"  \"captures\": [");
+	free(driver);
+
+	for (int i = 0; i < capture_count; i++)
+	{
+		const Capture*	capture = &captures[i];
+		time_t		seconds = (time_t)(capture->time / 1000000);
+		char		datetime[32];
+
+		strftime(datetime, sizeof(datetime), "%Y-%m-%dT%H:%M:%S", gmtime(&seconds));
+		fprintf(fp, "%s\n    { \"core:sample_start\": %ld, \"core:frequency\": %" PRId64 ", \"core:datetime\": \"%s.%06dZ\"",
+			i ? "," : "", capture->sample_start, capture->frequency, datetime, (int)(capture->time % 1000000));
+		if (capture->hardware_time)
+			fprintf(fp, ", \"powerscan:hardware_time\": %lld", capture->hardware_time);
+		fprintf(fp, " }");
+	}
+	if (annotation)
+		fprintf(fp, "\n  ],\n  \"annotations\": [\n    %s\n  ]\n}\n", annotation);
+	else
+		fprintf(fp, "\n  ],\n  \"annotations\": []\n}\n");
+	return fclose(fp) == 0;
+}
+
+// Work out the trigger power, and start the thread that writes captures
+bool start_trigger(ProgramConfiguration* pc)
+{
+	Trigger*	trigger = &pc->trigger;
+
+	if (!pc->stream_format->sigmf)
+	{
+		fprintf(stderr, "Can't write %s samples to SigMF, not triggering\n", pc->stream_format->name);
+		pc->triggered = false;
+		return true;
+	}
+
+	trigger->power = (float)(pow(10, trigger->level / 10) * window_gain(pc) * window_gain(pc));
+
+	trigger->running = true;
+	if (pthread_create(&trigger->thread, 0, trigger_thread, pc) != 0)
+	{
+		fprintf(stderr, "Can't start the trigger capture thread\n");
+		trigger->running = false;
+		return false;
+	}
+	if (pc->verbose)
+		fprintf(pc->verbose, "Capturing %dms before and %dms after any bin over %gdBFS, to %s-N.sigmf-data\n",
+			trigger->pre_ms, trigger->post_ms, trigger->level, trigger->prefix);
+	return true;
+}
+
+/*
+ * Add samples to the history for this tuning. A new tuning starts a new history,
+ * finishing any capture that is waiting for its post-trigger window.
+ */
+void keep_history(ProgramConfiguration* pc, const void* iq, int samples)
+{
+	Trigger*	trigger = &pc->trigger;
+	int		bytes = pc->stream_format->bytes;
+	const char*	in = (const char*)iq;
+
+	if (trigger->frequency != pc->current_frequency)
+	{
+		if (trigger->pending)
+			finish_trigger(pc);
+		trigger->frequency = pc->current_frequency;
+		trigger->total = 0;
+		trigger->processed = 0;
+	}
+
+	while (samples > 0)
+	{
+		long	position = trigger->total % trigger->capacity;
+		long	run = trigger->capacity - position;
+		if (run > samples)
+			run = samples;
+		memcpy(trigger->history + position * bytes, in, run * bytes);
+		in += run * bytes;
+		samples -= run;
+		trigger->total += run;
+	}
+
+	if (trigger->pending && trigger->total >= trigger->trigger_sample + (long)(trigger->post_ms * pc->sample_rate / 1000))
+		finish_trigger(pc);
+}
+
+// The FFT frame just processed has a bin over the trigger level
+void check_trigger(ProgramConfiguration* pc, int peak_bin, float peak_power)
+{
+	Trigger*	trigger = &pc->trigger;
+	long		pre = (long)(trigger->pre_ms * pc->sample_rate / 1000);
+
+	if (trigger->pending)
+		return;		// Already capturing this
+	trigger->pending = true;
+	trigger->trigger_sample = trigger->processed;
+	trigger->start = trigger->trigger_sample - pc->fft_size - pre;
+	if (trigger->start < 0)
+		trigger->start = 0;
+	if (trigger->start < trigger->total - trigger->capacity)
+		trigger->start = trigger->total - trigger->capacity;
+	trigger->peak_level = trigger->level + 10 * log10f(peak_power / trigger->power);
+	trigger->peak_frequency = pc->current_frequency - pc->tuning_bandwidth/2 + peak_bin * pc->frequency_resolution;
+	trigger->trigger_time = stream_time(pc);
+	if (pc->verbose)
+		fprintf(pc->verbose, "Triggered at %" PRId64 "Hz, %.1fdBFS\n", trigger->peak_frequency, trigger->peak_level);
+}
+
+// Copy the capture out of the history, and hand it to the writer thread
+void finish_trigger(ProgramConfiguration* pc)
+{
+	Trigger*	trigger = &pc->trigger;
+	int		bytes = pc->stream_format->bytes;
+	long		end = trigger->total;
+
+	trigger->pending = false;
+	if (__atomic_load_n(&trigger->event_ready, __ATOMIC_ACQUIRE))
+	{		// Still writing the last one
+		trigger->missed++;
+		return;
+	}
+
+	if (end > trigger->trigger_sample + (long)(trigger->post_ms * pc->sample_rate / 1000))
+		end = trigger->trigger_sample + (long)(trigger->post_ms * pc->sample_rate / 1000);
+	trigger->event_samples = 0;
+	for (long sample = trigger->start; sample < end; )
+	{
+		long	position = sample % trigger->capacity;
+		long	run = trigger->capacity - position;
+		if (run > end - sample)
+			run = end - sample;
+		memcpy(trigger->event + trigger->event_samples * bytes, trigger->history + position * bytes, run * bytes);
+		trigger->event_samples += run;
+		sample += run;
+	}
+
+	trigger->event_trigger = trigger->trigger_sample - pc->fft_size - trigger->start;
+	if (trigger->event_trigger < 0)
+		trigger->event_trigger = 0;
+	trigger->event_capture.sample_start = 0;
+	trigger->event_capture.frequency = trigger->frequency;
+	trigger->event_capture.time = trigger->trigger_time - (ClockTime)((trigger->trigger_sample - trigger->start) * 1e6 / pc->sample_rate);
+	trigger->event_capture.hardware_time = 0;
+	trigger->event_level = trigger->peak_level;
+	trigger->event_peak = trigger->peak_frequency;
+	__atomic_store_n(&trigger->event_ready, true, __ATOMIC_RELEASE);
+}
+
+void* trigger_thread(void* arg)
+{
+	ProgramConfiguration*	pc = (ProgramConfiguration*)arg;
+	Trigger*	trigger = &pc->trigger;
+
+	for (;;)
+	{
+		if (__atomic_load_n(&trigger->event_ready, __ATOMIC_ACQUIRE))
+		{
+			write_trigger_capture(pc);
+			__atomic_store_n(&trigger->event_ready, false, __ATOMIC_RELEASE);
+		}
+		else if (__atomic_load_n(&trigger->stop, __ATOMIC_ACQUIRE))
+			break;
+		else
+			usleep(RECORD_POLL_USLEEP);
+	}
+	return 0;
+}
+
+bool write_trigger_capture(ProgramConfiguration* pc)
+{
+	Trigger*	trigger = &pc->trigger;
+	size_t		length = strlen(trigger->prefix) + 32;
+	char*		path = (char*)malloc(length);
+	char		annotation[256];
+	FILE*		fp;
+	bool		ok;
+
+	snprintf(path, length, "%s-%d.sigmf-data", trigger->prefix, ++trigger->sequence);
+	if ((ok = (fp = fopen(path, "wb")) != 0))
+	{
+		ok = fwrite(trigger->event, pc->stream_format->bytes, trigger->event_samples, fp) == (size_t)trigger->event_samples;
+		ok = fclose(fp) == 0 && ok;
+	}
+	if (ok)
+	{
+		snprintf(annotation, sizeof(annotation),
+			"{ \"core:sample_start\": %ld, \"core:sample_count\": %d, \"core:freq_lower_edge\": %" PRId64 ", \"core:freq_upper_edge\": %" PRId64 ", \"core:comment\": \"Triggered at %.1fdBFS\" }",
+			trigger->event_trigger, pc->fft_size,
+			trigger->event_peak, trigger->event_peak + pc->frequency_resolution, trigger->event_level);
+		snprintf(path, length, "%s-%d.sigmf-meta", trigger->prefix, trigger->sequence);
+		ok = write_sigmf_meta(pc, path, &trigger->event_capture, 1, annotation);
+	}
+	if (!ok)
+		fprintf(stderr, "Can't write triggered capture %s: %s\n", path, strerror(errno));
+	else if (pc->verbose)
+		fprintf(pc->verbose, "Wrote %ld samples around the trigger at %" PRId64 "Hz to %s-%d\n", trigger->event_samples, trigger->event_peak, trigger->prefix, trigger->sequence);
+	free(path);
+	return ok;
+}
+
+// Write any capture still waiting for its post-trigger window, then stop the writer
+void stop_trigger(ProgramConfiguration* pc)
+{
+	Trigger*	trigger = &pc->trigger;
+
+	if (!trigger->running)
+		return;
+	if (trigger->pending)
+	{
+		while (__atomic_load_n(&trigger->event_ready, __ATOMIC_ACQUIRE))
+			usleep(RECORD_POLL_USLEEP);
+		finish_trigger(pc);
+	}
+	__atomic_store_n(&trigger->stop, true, __ATOMIC_RELEASE);
+	pthread_join(trigger->thread, 0);
+	trigger->running = false;
+	if (pc->verbose || trigger->missed)
+		fprintf(stderr, "Wrote %d triggered capture%s, missed %ld while writing\n", trigger->sequence, s_if_plural(trigger->sequence), trigger->missed);
+}
+
+/*
+ * Synthesise a set of known signals, either to measure how fast we can process samples,
+ * or to check that each one lands in the right power bucket.
+ * The sample rate is the -R limit, or SYNTH_SAMPLE_RATE.
+ */
+bool open_synthesiser(ProgramConfiguration* pc)
+{
+	Synthesiser*	synthesiser = &pc->synthesiser;
+	const char*	spec = pc->synthesise_spec;
+
+	while (*spec)
+	{
+		const char*	comma = strchr(spec, ',');
+		int		length = comma ? comma - spec : strlen(spec);
+
+		synthesiser->signals = (Signal*)realloc(synthesiser->signals, sizeof(Signal) * (synthesiser->signal_count+1));
+		if (!parse_signal(&synthesiser->signals[synthesiser->signal_count++], spec, length))
+		{
+			fprintf(stderr, "Invalid signal specification: %.*s\n", length, spec);
+			return false;
+		}
+		spec += length + (comma != 0);
+	}
+	if (!synthesiser->signals)
+	{
+		fprintf(stderr, "No signals to synthesise\n");
+		return false;
+	}
+
+	pc->sample_rate = pc->requested_sample_rate ? pc->requested_sample_rate : SYNTH_SAMPLE_RATE;
+	pc->stream_format = find_stream_format(SOAPY_SDR_CF32);
+	pc->native_format = pc->stream_format->name;
+	pc->full_scale = pc->stream_format->full_scale;
+	pc->sample_scale = (float)(1.0 / pc->full_scale);
+	pc->ring_blocks = 0;		// Generated on the DSP thread, no ring needed
+	synthesiser->random = 0x9E3779B97F4A7C15ULL;
+
+	// Without a frequency range, cover every signal:
+	if (pc->start_frequency <= 0)
+	{
+		Frequency	lowest = 0;
+		Frequency	highest = 0;
+
+		for (int i = 0; i < synthesiser->signal_count; i++)
+		{
+			Signal*	signal = &synthesiser->signals[i];
+			if (signal->kind == SIGNAL_NOISE)
+				continue;
+			if (!lowest || lowest > signal->frequency - signal->span/2)
+				lowest = signal->frequency - signal->span/2;
+			if (highest < signal->frequency + signal->span/2)
+				highest = signal->frequency + signal->span/2;
+		}
+		if (!lowest)
+		{
+			fprintf(stderr, "Give a frequency range with -s and -e to synthesise only noise\n");
+			return false;
+		}
+		pc->start_frequency = lowest - pc->sample_rate/4;
+		pc->end_frequency = highest + pc->sample_rate/4;
+	}
+
+	fprintf(stderr, "Synthesising %d signal%s at %g samples/s\n", synthesiser->signal_count, s_if_plural(synthesiser->signal_count), pc->sample_rate);
+	return true;
+}
+
+// kind:frequency[:parameter][:level]
+bool parse_signal(Signal* signal, const char* spec, int length)
+{
+	char		buf[80];
+	char*		field[4] = {0};
+	int		fields = 0;
+
+	if (length >= sizeof(buf))
+		return false;
+	memcpy(buf, spec, length);
+	buf[length] = '\0';
+	for (char* cp = buf; cp && fields < 4; fields++)
+	{
+		field[fields] = cp;
+		if ((cp = strchr(cp, ':')) != 0)
+			*cp++ = '\0';
+	}
+
+	memset(signal, 0, sizeof(*signal));
+	signal->phasor = 1;
+	signal->level = -20;
+	if (strcmp(field[0], "noise") == 0)
+	{
+		signal->kind = SIGNAL_NOISE;
+		signal->level = fields > 1 ? atof(field[1]) : -60;
+		return true;
+	}
+
+	if (fields < 2 || (signal->frequency = frequency_from_str(field[1])) <= 0)
+		return false;
+	if (strcmp(field[0], "tone") == 0)
+	{
+		signal->kind = SIGNAL_TONE;
+		if (fields > 2)
+			signal->level = atof(field[2]);
+		return fields <= 3;
+	}
+	if (fields < 3)
+		return false;
+	if (fields > 3)
+		signal->level = atof(field[3]);
+	if (strcmp(field[0], "chirp") == 0)
+	{
+		signal->kind = SIGNAL_CHIRP;
+		return (signal->span = frequency_from_str(field[2])) > 0;
+	}
+	if (strcmp(field[0], "burst") == 0)
+	{
+		signal->kind = SIGNAL_BURST;
+		signal->duty = atof(field[2]);
+		return signal->duty > 0 && signal->duty <= 1;
+	}
+	return false;
+}
+
+/*
+ * Fill the buffer with the next samples. Each carrier advances by multiplying its phasor
+ * by a fixed step, so there is no trigonometry per sample. Noise is drawn afresh for every sample,
+ * so frames averaged from different blocks are independent, as they are from a device.
+ */
+void synthesise_block(ProgramConfiguration* pc, int samples)
+{
+	Synthesiser*	synthesiser = &pc->synthesiser;
+	fftwf_complex*	out = synthesiser->buffer;
+	long		period = (long)(pc->sample_rate * SYNTH_PERIOD_MS / 1000);
+
+	if (synthesiser->noise_amplitude > 0)
+	{
+		uint64_t	r = synthesiser->random;
+
+		// xorshift64* gives two 24-bit uniforms per sample, made Gaussian by the Box-Muller transform:
+		for (int s = 0; s < samples; s++)
+		{
+			r ^= r >> 12;
+			r ^= r << 25;
+			r ^= r >> 27;
+
+			uint64_t	bits = r * 0x2545F4914F6CDD1DULL;
+			float		u = ((float)(bits >> 40) + 0.5f) / 16777216.0f;
+			float		v = ((float)((bits >> 16) & 0xFFFFFF) + 0.5f) / 16777216.0f;
+			float		radius = sqrtf(-logf(u)) * synthesiser->noise_amplitude;	// Half the power on each of I and Q
+
+			out[s] = radius * cosf(2 * (float)M_PI * v) + I * (radius * sinf(2 * (float)M_PI * v));
+		}
+		synthesiser->random = r;
+	}
+	else
+		memset(out, 0, sizeof(fftwf_complex) * samples);
+
+	for (int i = 0; i < synthesiser->signal_count; i++)
+	{
+		Signal*		signal = &synthesiser->signals[i];
+		double		offset = (double)(signal->frequency - signal->span/2 - pc->current_frequency);
+		float		amplitude = powf(10, signal->level / 20);
+		fftwf_complex	phasor = signal->phasor;
+		fftwf_complex	step = cexpf(I * (float)(2 * M_PI * offset / pc->sample_rate));
+		long		position = (synthesiser->sample % period);
+
+		// Signals outside the band are removed by the anti-aliasing filter:
+		if (signal->kind == SIGNAL_NOISE
+		 || offset + signal->span < -pc->sample_rate/2
+		 || offset > pc->sample_rate/2)
+			continue;
+
+		switch (signal->kind)
+		{
+		case SIGNAL_TONE:
+			for (int s = 0; s < samples; s++)
+			{
+				out[s] += phasor * amplitude;
+				phasor *= step;
+			}
+			break;
+
+		case SIGNAL_CHIRP:
+		{
+			fftwf_complex	sweep = cexpf(I * (float)(2 * M_PI * signal->span / pc->sample_rate / period));
+			fftwf_complex	chirp = step * cpowf(sweep, position);
+
+			for (int s = 0; s < samples; s++)
+			{
+				out[s] += phasor * amplitude;
+				phasor *= chirp;
+				chirp *= sweep;
+				if (++position == period)
+				{
+					position = 0;
+					chirp = step;
+				}
+			}
+			break;
+		}
+
+		case SIGNAL_BURST:
+		{
+			long	on = (long)(period * signal->duty);
+
+			for (int s = 0; s < samples; s++)
+			{
+				if (position < on)
+					out[s] += phasor * amplitude;
+				phasor *= step;
+				if (++position == period)
+					position = 0;
+			}
+			break;
+		}
+
+		case SIGNAL_NOISE:
+			break;
+		}
+
+		// Stop rounding errors accumulating in the phasor's magnitude:
+		signal->phasor = phasor / cabsf(phasor);
+	}
+	synthesiser->sample += samples;
+}
+
+// Scan the synthesised signals. Each tuning generates a dwell of samples as fast as they can be processed.
+bool synthesise(ProgramConfiguration* pc)
+{
+	Synthesiser*	synthesiser = &pc->synthesiser;
+	Frequency	frequency = pc->tuning_start;
+	long		samples_processed = 0;
+	ClockTime	generate_time = 0;
+	ClockTime	process_time = 0;
+
+	// The noise sources add in power:
+	if (synthesiser->noise_amplitude == 0)
+	{
+		for (int i = 0; i < synthesiser->signal_count; i++)
+			if (synthesiser->signals[i].kind == SIGNAL_NOISE)
+				synthesiser->noise_amplitude += powf(10, synthesiser->signals[i].level / 10);
+		synthesiser->noise_amplitude = sqrtf(synthesiser->noise_amplitude);
+	}
+
+	// Synthesised time carries on from one scan to the next, like a device's
+	if (!pc->stream_clock.counted)
+		start_stream_clock(pc, clock_time());
+	pc->last_time = stream_time(pc);
+
+	for (int i = 0; i < pc->tuning_count && signals_caught <= 1; i++, frequency += pc->tuning_step)
+	{
+		// A retune changes what is generated, and starts a new FFT frame:
+		transform_frames(pc);
+		pc->current_frequency = frequency;
+		pc->fft_fill = 0;
+		synthesiser->sample = 0;
+
+		// Dwell for the same time as scan() would, in samples:
+		pc->dwell_end_time = pc->last_time + pc->dwell_time;
+		while (pc->last_time < pc->dwell_end_time && signals_caught <= 1)
+		{
+			long		remaining = samples_until(pc, pc->dwell_end_time);
+			int		samples = remaining > MAX_SAMPLES ? MAX_SAMPLES : (int)remaining;
+			ClockTime	start = clock_time();
+			ClockTime	generated;
+
+			synthesise_block(pc, samples);
+			generated = clock_time();
+			advance_stream_clock(pc, samples);
+			process_buffer(pc, synthesiser->buffer, samples);
+			generate_time += generated - start;
+			process_time += clock_time() - generated;
+			samples_processed += samples;
+		}
+	}
+	transform_frames(pc);
+
+	if (pc->verbose)
+	{
+		fprintf(pc->verbose, "Synthesised %ld samples in %.3fs, processed them in %.3fs: %.1f Msamples/s, %.1f times real time\n",
+			samples_processed, generate_time / 1e6, process_time / 1e6,
+			process_time > 0 ? samples_processed / (process_time / 1e6) / 1e6 : 0,
+			process_time > 0 ? samples_processed / (process_time / 1e6) / pc->sample_rate : 0);
+		check_synthesised_signals(pc, pc->verbose);
+	}
+	return true;
+}
+
+// Report whether each synthesised carrier (not chirps or noise, which are spread) was accumulated in the bucket for its frequency
+void check_synthesised_signals(ProgramConfiguration* pc, FILE* fp)
+{
+	Synthesiser*	synthesiser = &pc->synthesiser;
+	double		mean = 0;
+
+	for (int b = 0; b < pc->power_buckets; b++)
+		mean += pc->power_accumulation[b];
+	mean /= pc->power_buckets;
+
+	for (int i = 0; i < synthesiser->signal_count; i++)
+	{
+		Signal*		signal = &synthesiser->signals[i];
+		int		expected = (int)((signal->frequency - pc->start_frequency) / pc->frequency_resolution);
+		int		peak = -1;
 
-	if (lowest_bin < 0 || lowest_bin+bin_count > pc->power_buckets)
-		return;	// Sometimes happens on interrupt
+		if (signal->kind == SIGNAL_NOISE || signal->kind == SIGNAL_CHIRP || expected < 0 || expected >= pc->power_buckets)
+			continue;
+		for (int b = expected - SYNTH_SEARCH; b <= expected + SYNTH_SEARCH; b++)
+			if (b >= 0 && b < pc->power_buckets && (peak < 0 || pc->power_accumulation[b] > pc->power_accumulation[peak]))
+				peak = b;
+
+		fprintf(fp, "Signal at %" PRId64 " expected in bucket %d, peak in bucket %d (%+d) at %.1fdB over the mean%s\n",
+			signal->frequency, expected, peak, peak - expected,
+			10 * log10(pc->power_accumulation[peak] / mean),
+			abs(peak - expected) <= 1 ? "" : ", MISPLACED");
+	}
+}
 
-	for (int s = 0; s < bin_count; s++)
-		pc->power_accumulation[lowest_bin+s] += pc->fft_power[s];
-	pc->accumulation_count++;
+void close_synthesiser(Synthesiser* synthesiser)
+{
+	free(synthesiser->signals);
+	memset(synthesiser, 0, sizeof(*synthesiser));
 }
 
 void print_soapy_flags(FILE* fp, int flags)
@@ -359,27 +3926,24 @@ void list_sdr_devices(FILE* fp)
 	SoapySDRKwargsList_clear(kw_args, kw_length);
 }
 
-// Report the capabilities of this device (save what we need):
+// Report the capabilities of this device:
 void list_device_capabilities(ProgramConfiguration* pc)
 {
-	SoapySDRKwargs arg;
+	SoapySDRKwargs* arg = &pc->hardware_info;
 
-	arg = SoapySDRDevice_getHardwareInfo(pc->device);
 	if (pc->verbose)
 	{
-		fprintf(pc->verbose, "SoapySDR Device capabilities:\n");
-		for (int i = 0; i < arg.size; i++)
-			fprintf(pc->verbose, "\t%s\t%s\n", arg.keys[i], arg.vals[i]);
+		fprintf(pc->verbose, "SoapySDR Device capabilities%s:\n", pc->capabilities_cached ? " (cached)" : "");
+		for (int i = 0; i < arg->size; i++)
+			fprintf(pc->verbose, "\t%s\t%s\n", arg->keys[i], arg->vals[i]);
 		fprintf(pc->verbose, "\n");
 	}
 }
 
-// Report the sample rates of this device (save what we need):
+// Report the sample rates of this device:
 // REVISIT: Provide a command-line argument to list these:
 void list_sample_rates(ProgramConfiguration* pc)
 {
-	pc->sample_rates = SoapySDRDevice_listSampleRates(pc->device, SOAPY_SDR_RX, pc->sdr_channel, &pc->num_sample_rates);
-
 	if (pc->verbose)
 	{
 		fprintf(pc->verbose, "SoapySDR Device (Channel 0 Receive) has %zu sample rates:", pc->num_sample_rates);
@@ -407,30 +3971,100 @@ bool initialise_configuration(ProgramConfiguration* pc)
 {
 	const char*	error_p;
 
-	// Open the SDR device requested, or list available devices if that failed:
-	pc->device = SoapySDRDevice_makeStrArgs(pc->sdr_name);
-	if (!pc->device)
+	// Receivers are given the kernels chosen for the scan
+	if (!pc->kernels && !select_kernels(pc))
+		return false;
+
+	// Limit the crop ratio to something sensible:
+	if (pc->crop_ratio > MAX_CROP_RATIO)
+		pc->crop_ratio = MAX_CROP_RATIO;
+	else if (pc->crop_ratio < 0)
+		pc->crop_ratio = 0;
+
+	if (pc->socket_path && (pc->sdr_name_count > 1 || pc->stream_channels > 1 || pc->record_base || pc->triggered))
+	{		// Each request replans the scan, which would need doing on every receiver, recorder and trigger
+		fprintf(stderr, "A daemon scans with one channel of one device, without recording or triggering\n");
+		return false;
+	}
+#ifdef _WIN32
+	if (pc->socket_path)
 	{
-		fprintf(stderr, "SoapySDR device %s not found.\n", pc->sdr_name);
-		fprintf(stderr, "SoapySDR error: %s\n", SoapySDRDevice_lastError());
-		list_sdr_devices(stderr);
+		fprintf(stderr, "Daemon mode needs Unix sockets\n");
+		return false;
+	}
+#endif
+
+	if ((pc->sdr_name_count > 1 || pc->stream_channels > 1) && !pc->receiver_share && !pc->replay_path && !pc->synthesise_spec)
+		return initialise_receivers(pc);
+
+	if (pc->stream_owner)
+		share_stream(pc);
+	else if (pc->replay_path)
+	{
+		if (!open_recording(pc))
+			return false;
+	}
+	else if (pc->synthesise_spec)
+	{
+		if (!open_synthesiser(pc))
+			return false;
+	}
+	else if (!open_device(pc))
+		return false;
 
+	if (!plan_frequencies(pc))
 		return false;
+
+	if (pc->device)
+	{
+		if (!pc->stream_owner)
+			select_stream_format(pc);
+
+		// HackR LNA max is 40, VGA 62, AMP 14, total 116
+		if (SoapySDRDevice_setGain(pc->device, SOAPY_SDR_RX, pc->sdr_channel, pc->gain) != 0) {
+			fprintf(stderr, "Failed to set gain\n");
+		}
+
+		list_channel_variables(pc);
 	}
 
-	// Provide verbose output if requested:
-	list_device_capabilities(pc);
+	plan_tuning(pc);
 
-	list_sample_rates(pc);
+	if (pc->device && !pc->stream_owner)
+	{
+		error_p = setup_stream(pc);
+		if (error_p)
+		{
+			fprintf(stderr, "Can't setup stream: %s\n", error_p);
+			return false;
+		}
+	}
 
-	select_sample_rate(pc);
+	if (!plan_fft(pc))
+		return false;
 
-	// Limit the crop ratio to something sensible:
-	if (pc->crop_ratio > MAX_CROP_RATIO)
-		pc->crop_ratio = MAX_CROP_RATIO;
-	else if (pc->crop_ratio < 0)
-		pc->crop_ratio = 0;
+	setup_interrupts();
+
+	if (pc->record_base && !pc->device)
+	{
+		fprintf(stderr, "Only samples received from a device can be recorded\n");
+		pc->record_base = 0;
+	}
+	if (pc->record_base && !start_recorder(pc))
+		return false;
+	if (pc->triggered && !start_trigger(pc))
+		return false;
 
+	// Several channels share one acquisition thread, started once every channel has its ring
+	if (pc->device && pc->channel_share <= 1 && !start_acquisition(pc))
+		return false;
+
+	return true;
+}
+
+// Check the requested frequencies, filling in any not given
+bool plan_frequencies(ProgramConfiguration* pc)
+{
 	if (pc->start_frequency <= 0)
 	{
 		fprintf(stderr, "No start frequency was given\n");
@@ -462,46 +4096,289 @@ bool initialise_configuration(ProgramConfiguration* pc)
 		if (pc->frequency_resolution == 0)
 			pc->frequency_resolution = 1;	// Do any SDRs have a sample rate below 65536 SPS?
 	}
+	return true;
+}
+
+// Open the SDR device requested, or list available devices if that failed
+bool open_device(ProgramConfiguration* pc)
+{
+	pc->device = SoapySDRDevice_makeStrArgs(pc->sdr_name);
+	if (!pc->device)
+	{
+		fprintf(stderr, "SoapySDR device %s not found.\n", pc->sdr_name);
+		fprintf(stderr, "SoapySDR error: %s\n", SoapySDRDevice_lastError());
+		list_sdr_devices(stderr);
 
-	// Display the native stream data format. We use CS16 anyway, for now.
-	double		full_scale = 0;
-	const char*	native_format = SoapySDRDevice_getNativeStreamFormat(pc->device, SOAPY_SDR_RX, pc->sdr_channel, &full_scale);
-	fprintf(stderr, "Native stream format is %s with fullscale of %g\n", native_format, full_scale);
+		return false;
+	}
 
-	// HackR LNA max is 40, VGA 62, AMP 14, total 116
-	if (SoapySDRDevice_setGain(pc->device, SOAPY_SDR_RX, pc->sdr_channel, pc->gain) != 0) {
-		fprintf(stderr, "Failed to set gain\n");
+	// Ask the device what it can do, unless we asked it last time. Its hardware info tells which one it is:
+	pc->hardware_info = SoapySDRDevice_getHardwareInfo(pc->device);
+	pc->capability_cache = capability_cache_path(pc);
+	if (pc->probe_again || !load_capabilities(pc))
+	{
+		probe_capabilities(pc);
+		save_capabilities(pc);
 	}
 
-	list_channel_variables(pc);
+	// Provide verbose output if requested:
+	list_device_capabilities(pc);
+
+	list_sample_rates(pc);
 
-	plan_tuning(pc);
+	select_sample_rate(pc);
+	return true;
+}
+
+// Query everything about the device and sdr_channel that we need, or list with -v
+void probe_capabilities(ProgramConfiguration* pc)
+{
+	pc->capabilities_cached = false;
+	pc->channel_info = SoapySDRDevice_getChannelInfo(pc->device, SOAPY_SDR_RX, pc->sdr_channel);
+	pc->channel_count = SoapySDRDevice_getNumChannels(pc->device, SOAPY_SDR_RX);
+	pc->hardware_time = SoapySDRDevice_hasHardwareTime(pc->device, "");
+	pc->sample_rates = SoapySDRDevice_listSampleRates(pc->device, SOAPY_SDR_RX, pc->sdr_channel, &pc->num_sample_rates);
+	pc->native_format = SoapySDRDevice_getNativeStreamFormat(pc->device, SOAPY_SDR_RX, pc->sdr_channel, &pc->full_scale);
+}
 
-	error_p = setup_stream(pc);
-	if (error_p)
+/*
+ * Probing some devices takes hundreds of milliseconds, which matters when we're run often.
+ * The capabilities of each channel are cached in a file named after the driver and the serial number the device reports
+ * (or the one asked for, or the hardware key, if it reports none). They're only used with the same SoapySDR, hardware key
+ * and hardware info, which is where drivers report their firmware and driver versions.
+ */
+char* capability_cache_path(ProgramConfiguration* pc)
+{
+	const char*	home = getenv("XDG_CACHE_HOME");
+	const char*	subdirectory = "/powerscan";
+	char*		driver = SoapySDRDevice_getDriverKey(pc->device);
+	char*		hardware = SoapySDRDevice_getHardwareKey(pc->device);
+	SoapySDRKwargs	args = SoapySDRKwargs_fromString(pc->sdr_name ? pc->sdr_name : "");
+	const char*	serial = SoapySDRKwargs_get(&pc->hardware_info, "serial");
+	char*		path = 0;
+	size_t		length;
+
+#ifdef _WIN32
+	if (!home)
+		home = getenv("LOCALAPPDATA");
+#else
+	if (!home && (home = getenv("HOME")) != 0)
+		subdirectory = "/.cache/powerscan";
+#endif
+	if (!serial || !*serial)
+		serial = SoapySDRKwargs_get(&args, "serial");
+	if (home && driver)
 	{
-		fprintf(stderr, "Can't setup stream: %s\n", error_p);
-		return false;
+		length = strlen(home) + strlen(subdirectory) + strlen(driver) + strlen(serial ? serial : hardware ? hardware : "") + 32;
+		path = (char*)malloc(length);
+		snprintf(path, length, "%s%s", home, subdirectory);
+#ifdef _WIN32
+		_mkdir(path);
+#else
+		mkdir(path, 0755);
+#endif
+		char*	name = path + strlen(path) + 1;
+		snprintf(path + strlen(path), length - strlen(path), "/%s-%s-%d", driver, serial ? serial : hardware ? hardware : "", pc->sdr_channel);
+		for (char* p = name; *p; p++)		// Keep the name to one file in the directory
+			if (!isalnum((unsigned char)*p) && *p != '-' && *p != '.')
+				*p = '_';
 	}
+	SoapySDRKwargs_clear(&args);
+	free(driver);
+	free(hardware);
+	return path;
+}
 
-	if (!plan_fft(pc))
+// Use the cached capabilities, if they're from the same SoapySDR, hardware and driver version
+bool load_capabilities(ProgramConfiguration* pc)
+{
+	FILE*		fp = pc->capability_cache ? fopen(pc->capability_cache, "r") : 0;
+	char*		hardware = SoapySDRDevice_getHardwareKey(pc->device);
+	char		line[4096];
+	bool		same_soapy = false;
+	bool		same_hardware = false;
+	bool		same_info = true;
+	size_t		info_count = 0;
+	bool		have_format = false;
+
+	if (!fp)
+	{
+		free(hardware);
 		return false;
+	}
+	while (fgets(line, sizeof(line), fp))
+	{
+		char*	value = strchr(line, '\t');
 
-	setup_interrupts();
+		line[strcspn(line, "\n")] = '\0';
+		if (!value)
+			continue;
+		*value++ = '\0';
+		if (strcmp(line, "soapysdr") == 0)
+			same_soapy = strcmp(value, SoapySDR_getLibVersion()) == 0;
+		else if (strcmp(line, "hardware") == 0)
+			same_hardware = hardware && strcmp(value, hardware) == 0;
+		else if (strcmp(line, "channels") == 0)
+			pc->channel_count = strtoul(value, 0, 10);
+		else if (strcmp(line, "hardware_time") == 0)
+			pc->hardware_time = atoi(value) != 0;
+		else if (strcmp(line, "native_format") == 0)
+		{
+			char*	scale = strchr(value, '\t');
+			if (scale)
+				*scale++ = '\0';
+			pc->native_format = strdup(value);
+			pc->full_scale = scale ? strtod(scale, 0) : 0;
+			have_format = true;
+		}
+		else if (strcmp(line, "sample_rates") == 0)
+		{
+			char*	p = value;
+			char*	end;
+			double	rate;
 
-	return true;
+			while ((rate = strtod(p, &end)), end != p)
+			{
+				pc->sample_rates = (double*)realloc(pc->sample_rates, sizeof(double) * (pc->num_sample_rates+1));
+				pc->sample_rates[pc->num_sample_rates++] = rate;
+				p = end;
+			}
+		}
+		else if (strcmp(line, "info") == 0 || strcmp(line, "channel_info") == 0)
+		{
+			char*	info_value = strchr(value, '\t');
+			if (info_value)
+				*info_value++ = '\0';
+			if (line[0] == 'i')
+			{		// Must match what the device reports now
+				const char*	now = SoapySDRKwargs_get(&pc->hardware_info, value);
+				if (!now || strcmp(now, info_value ? info_value : "") != 0)
+					same_info = false;
+				info_count++;
+			}
+			else
+				SoapySDRKwargs_set(&pc->channel_info, value, info_value ? info_value : "");
+		}
+	}
+	fclose(fp);
+	free(hardware);
+
+	if (info_count != pc->hardware_info.size)
+		same_info = false;
+	pc->capabilities_cached = same_soapy && same_hardware && same_info && have_format && pc->num_sample_rates > 0 && pc->channel_count > 0;
+	if (!pc->capabilities_cached)
+	{		// Stale or incomplete, so probe again
+		if (pc->verbose)
+			fprintf(pc->verbose, "Ignoring out-of-date capabilities in %s\n", pc->capability_cache);
+		free(pc->sample_rates);
+		pc->sample_rates = 0;
+		pc->num_sample_rates = 0;
+		free((void*)pc->native_format);
+		pc->native_format = 0;
+		SoapySDRKwargs_clear(&pc->channel_info);
+	}
+	else if (pc->verbose)
+		fprintf(pc->verbose, "Using device capabilities cached in %s\n", pc->capability_cache);
+	return pc->capabilities_cached;
+}
+
+// Write what we probed, for next time. Written to a new file and renamed, in case another powerscan is reading it
+void save_capabilities(ProgramConfiguration* pc)
+{
+	char*		hardware = SoapySDRDevice_getHardwareKey(pc->device);
+	char*		temporary;
+	size_t		length;
+	FILE*		fp;
+
+	if (!pc->capability_cache || !hardware || !pc->native_format)
+	{
+		free(hardware);
+		return;
+	}
+	length = strlen(pc->capability_cache) + 16;
+	temporary = (char*)malloc(length);
+#ifdef _WIN32
+	snprintf(temporary, length, "%s.new", pc->capability_cache);
+#else
+	snprintf(temporary, length, "%s.%d", pc->capability_cache, (int)getpid());
+#endif
+	if ((fp = fopen(temporary, "w")) != 0)
+	{
+		fprintf(fp, "soapysdr\t%s\n", SoapySDR_getLibVersion());
+		fprintf(fp, "hardware\t%s\n", hardware);
+		fprintf(fp, "channels\t%zu\n", pc->channel_count);
+		fprintf(fp, "hardware_time\t%d\n", pc->hardware_time);
+		fprintf(fp, "native_format\t%s\t%.17g\n", pc->native_format, pc->full_scale);
+		fprintf(fp, "sample_rates\t");
+		for (int i = 0; i < pc->num_sample_rates; i++)
+			fprintf(fp, "%s%.17g", i ? " " : "", pc->sample_rates[i]);
+		fprintf(fp, "\n");
+		for (int i = 0; i < pc->hardware_info.size; i++)
+			fprintf(fp, "info\t%s\t%s\n", pc->hardware_info.keys[i], pc->hardware_info.vals[i]);
+		for (int i = 0; i < pc->channel_info.size; i++)
+			fprintf(fp, "channel_info\t%s\t%s\n", pc->channel_info.keys[i], pc->channel_info.vals[i]);
+		if (fclose(fp) == 0)
+		{
+#ifdef _WIN32
+			remove(pc->capability_cache);
+#endif
+			if (rename(temporary, pc->capability_cache) != 0)
+				remove(temporary);
+		}
+		else
+			remove(temporary);
+	}
+	free(temporary);
+	free(hardware);
+}
+
+// Receive on another channel of the stream the owner set up
+void share_stream(ProgramConfiguration* pc)
+{
+	ProgramConfiguration* owner = pc->stream_owner;
+
+	pc->device = owner->device;
+	pc->stream = owner->stream;
+	pc->sample_rate = owner->sample_rate;
+	pc->native_format = owner->native_format;
+	pc->full_scale = owner->full_scale;
+	pc->stream_format = owner->stream_format;
+	pc->sample_scale = owner->sample_scale;
+	pc->channel_count = owner->channel_count;
+	pc->settle_time = owner->settle_time;
+	pc->hardware_time = owner->hardware_time;
+	pc->queue_samples = owner->queue_samples;
+	pc->timed_commands = owner->timed_commands;
+	pc->burst_mode = owner->burst_mode;
+	pc->pipelined = owner->pipelined;
+	pc->direct_buffers = 0;
+}
+
+// Receive in the native stream data format if we can convert it, otherwise let Soapy convert to CS16
+void select_stream_format(ProgramConfiguration* pc)
+{
+	pc->stream_format = find_stream_format(pc->native_format);
+	if (!pc->stream_format || ((pc->record_base || pc->triggered) && !pc->stream_format->sigmf))
+	{		// SigMF has no packed 12-bit type
+		pc->stream_format = find_stream_format(SOAPY_SDR_CS16);
+		pc->full_scale = 0;
+	}
+	if (pc->full_scale <= 0)
+		pc->full_scale = pc->stream_format->full_scale;
+	pc->sample_scale = (float)(1.0 / pc->full_scale);
+	fprintf(stderr, "Native stream format is %s, receiving %s with fullscale of %g\n", pc->native_format, pc->stream_format->name, pc->full_scale);
 }
 
 // REVISIT: Provide command-line arguments for setting these, and a help option to list them:
 void list_channel_variables(ProgramConfiguration* pc)
 {
-	// Fetch and list any channe; information variables for this channel:
-	SoapySDRKwargs	channel_info = SoapySDRDevice_getChannelInfo(pc->device, SOAPY_SDR_RX, pc->sdr_channel);
-	if (pc->verbose && channel_info.size > 0)
+	// List any channel information variables for this channel:
+	SoapySDRKwargs*	channel_info = &pc->channel_info;
+	if (pc->verbose && channel_info->size > 0)
 	{
-		fprintf(pc->verbose, "%ld info items for channel %d: ", channel_info.size, pc->sdr_channel);
-		for (int j = 0; j < channel_info.size; j++)
-			fprintf(pc->verbose, "%s=%s ", channel_info.keys[j], channel_info.vals[j]);
+		fprintf(pc->verbose, "%ld info items for channel %d: ", channel_info->size, pc->sdr_channel);
+		for (int j = 0; j < channel_info->size; j++)
+			fprintf(pc->verbose, "%s=%s ", channel_info->keys[j], channel_info->vals[j]);
 		fprintf(pc->verbose, "\n");
 	}
 }
@@ -521,6 +4398,7 @@ void plan_tuning(ProgramConfiguration* pc)
 
 	// How many times must we tune to cover the frequency range:
 	pc->tuning_count = (int)ceil((double)total_scan / pc->tuning_bandwidth);
+	pc->tuning_step = pc->tuning_bandwidth;
 
 	// How long can we dwell on each tuning:
 	pc->dwell_time = 1000000*pc->scan_time/pc->tuning_count;
@@ -544,6 +4422,37 @@ void plan_tuning(ProgramConfiguration* pc)
 		pc->tuning_bandwidth,
 		pc->dwell_time/1000
 	);
+
+	// Receivers sharing the scan each take a contiguous share of the tunings, with the same dwell time,
+	// so the scan takes less time instead of dwelling for longer:
+	if (pc->receiver_share > 1)
+	{
+		int	share = (pc->tuning_count + pc->receiver_share - 1) / pc->receiver_share;
+		int	first = share * pc->receiver_index;
+
+		if (first > pc->tuning_count)
+			first = pc->tuning_count;
+		if (share > pc->tuning_count - first)
+			share = pc->tuning_count - first;
+		pc->tuning_start += first * pc->tuning_bandwidth;
+		pc->tuning_count = share;
+		fprintf(stderr, "Receiver %d scans %d tuning%s from %" PRId64 "\n",
+			pc->receiver_index, pc->tuning_count, s_if_plural(pc->tuning_count), pc->tuning_start);
+	}
+
+	// The channels of a device interleave their tunings within its share, so each retunes half as often (or less)
+	if (pc->channel_share > 1)
+	{
+		int	count = pc->tuning_count > pc->channel_index
+				? (pc->tuning_count - pc->channel_index + pc->channel_share - 1) / pc->channel_share
+				: 0;
+
+		pc->tuning_start += pc->channel_index * pc->tuning_bandwidth;
+		pc->tuning_step = pc->channel_share * pc->tuning_bandwidth;
+		pc->tuning_count = count;
+		fprintf(stderr, "Channel %d scans %d tuning%s from %" PRId64 " in steps of %" PRId64 "Hz\n",
+			pc->sdr_channel, pc->tuning_count, s_if_plural(pc->tuning_count), pc->tuning_start, pc->tuning_step);
+	}
 }
 
 bool plan_fft(ProgramConfiguration* pc)
@@ -551,6 +4460,7 @@ bool plan_fft(ProgramConfiguration* pc)
 	pc->fft_size = pc->sample_rate / pc->frequency_resolution;
 	pc->fft_size = 8192;
 	pc->fft_fill = 0;
+	pc->batch_fill = 0;
 	if (pc->fft_size < 4)
 		pc->fft_size = 4;
 	pc->frequency_resolution = pc->sample_rate/pc->fft_size;
@@ -562,23 +4472,40 @@ bool plan_fft(ProgramConfiguration* pc)
 	fprintf(stderr, "Frequency Resolution \t%" PRId64 "\n", pc->frequency_resolution);
 	fprintf(stderr, "Power buckets\t%d\n", pc->power_buckets);
 
-	pc->fftw_in = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * pc->fft_size);
-	pc->fftw_out = (fftwf_complex*)fftwf_malloc(sizeof(fftwf_complex) * pc->fft_size);
-	pc->window = (float*)fftwf_malloc(sizeof(float) * pc->fft_size);
-	pc->fft_power = (float*)malloc(sizeof(float) * pc->fft_size);
-	pc->power_accumulation = (float*)calloc(pc->power_buckets, sizeof(float));
+	// Small frames are transformed in batches. Triggering looks at each frame as soon as it's complete.
+	pc->fft_batch = pc->requested_batch > 0 ? pc->requested_batch : (FFT_BATCH_SAMPLES + pc->fft_size-1) / pc->fft_size;
+	if (pc->fft_batch > MAX_FFT_BATCH)
+		pc->fft_batch = MAX_FFT_BATCH;
+	if (pc->triggered)
+		pc->fft_batch = 1;
+	if (pc->verbose)
+		fprintf(pc->verbose, "FFT batch\t%d frame%s\n", pc->fft_batch, s_if_plural(pc->fft_batch));
+
+	// Overlapping frames average the samples near each frame's edges too, where the window makes them count for little
+	pc->frame_hop = pc->fft_size - pc->fft_size * pc->overlap_percent / 100;
+	if (pc->frame_hop < 1)
+		pc->frame_hop = 1;
+	if (pc->verbose && pc->frame_hop < pc->fft_size)
+		fprintf(pc->verbose, "Frames overlap\t%d%%, starting every %d samples\n", pc->overlap_percent, pc->frame_hop);
+
 	pc->accumulation_count = 0;
-	if (!pc->fftw_in
-	 || !pc->fftw_out
-	 || !pc->window
-	 || !pc->fft_power
-	 || !pc->power_accumulation)
+	if (!allocate_buffers(pc))
 	{
-		fprintf(stderr, "Unable to allocate FFT memory\n");
+		fprintf(stderr, "Unable to allocate sample and FFT memory\n");
 		return false;
 	}
 
-	pc->fftw_plan = fftwf_plan_dft_1d(pc->fft_size, pc->fftw_in, pc->fftw_out, FFTW_FORWARD, FFTW_MEASURE);
+	pc->fftw_plan = fftwf_plan_many_dft(1, &pc->fft_size, pc->fft_batch,
+		pc->fftw_in, 0, 1, pc->fft_size, pc->fftw_out, 0, 1, pc->fft_size, FFTW_FORWARD, FFTW_MEASURE);
+
+	// A partial batch is transformed a frame at a time, with a plan that must suit every frame of both buffers, not just the first:
+	if (pc->fft_batch > 1)
+	{
+		bool	aligned = fftwf_alignment_of((float*)(pc->fftw_in + pc->fft_size)) == fftwf_alignment_of((float*)pc->fftw_in)
+			&& fftwf_alignment_of((float*)(pc->fftw_out + pc->fft_size)) == fftwf_alignment_of((float*)pc->fftw_out);
+
+		pc->fftw_frame_plan = fftwf_plan_dft_1d(pc->fft_size, pc->fftw_in, pc->fftw_out, FFTW_FORWARD, FFTW_MEASURE | (aligned ? 0 : FFTW_UNALIGNED));
+	}
 fprintf(stderr, "FFT Size %d, in=%p, out=%p\n", pc->fft_size, pc->fftw_in, pc->fftw_out);
 
 	// Populate the window function
@@ -586,17 +4513,30 @@ fprintf(stderr, "FFT Size %d, in=%p, out=%p\n", pc->fft_size, pc->fftw_in, pc->f
 		pc->window[s] = (float) (0.5f * (1.0f - cos(2 * M_PI * s / (pc->fft_size - 1))));
 	}
 
+	// Fold the sample scale into the window, so conversion only multiplies:
+	for (int s = 0; s < pc->fft_size; s++)
+		pc->window_iq[2*s] = pc->window_iq[2*s+1] = pc->window[s] * pc->sample_scale;
+	pc->convert = format_converter(pc->kernels, pc->stream_format);
+
 	return true;
 }
 
-// Set up a receiver data stream on the specified channel
+// Set up a receiver data stream on the specified channel, and the channels after it if streaming several
 const char* setup_stream(ProgramConfiguration* pc)
 {
 	SoapySDRKwargs	stream_args = {0};
-	size_t		sdr_channel = pc->sdr_channel;
+	size_t		sdr_channels[MAX_STREAM_CHANNELS];
+	int		count = pc->stream_channels > 1 ? pc->stream_channels : 1;
 
-	pc->channel_count = SoapySDRDevice_getNumChannels(pc->device, SOAPY_SDR_RX);
-	if ((size_t)pc->sdr_channel >= pc->channel_count)
+	for (int c = 0; c < count; c++)
+		sdr_channels[c] = pc->sdr_channel + c;
+
+	if (pc->settle_time < 0)
+		pc->settle_time = device_settle_time(pc);
+	pc->timed_commands = pc->hardware_time;		// Until we find out otherwise
+	if (pc->verbose)
+		fprintf(pc->verbose, "Retunes settle for %dus, measured by %s\n", pc->settle_time, pc->hardware_time ? "device time" : "sample count");
+	if ((size_t)(pc->sdr_channel + count) > pc->channel_count)
 	{
 		fprintf(stderr, "Device has only %zu channel%s\n", pc->channel_count, s_if_plural(pc->channel_count));
 		return "Invalid channel selected";
@@ -604,15 +4544,44 @@ const char* setup_stream(ProgramConfiguration* pc)
 
 #if SOAPY_SDR_API_VERSION < 0x00080000
 	// REVISIT: This Soapy API prints an [INFO] message without being asked
-	if (SoapySDRDevice_setupStream(pc->device, &pc->stream, SOAPY_SDR_RX, SOAPY_SDR_CS16, &sdr_channel, 1, &stream_args) != 0)
+	if (SoapySDRDevice_setupStream(pc->device, &pc->stream, SOAPY_SDR_RX, pc->stream_format->name, sdr_channels, count, &stream_args) != 0)
 		return SoapySDRDevice_lastError();
 #else
-	pc->stream = SoapySDRDevice_setupStream(pc->device, SOAPY_SDR_RX, SOAPY_SDR_CS16, &sdr_channel, 1, &stream_args);
+	pc->stream = SoapySDRDevice_setupStream(pc->device, SOAPY_SDR_RX, pc->stream_format->name, sdr_channels, count, &stream_args);
 	if (pc->stream == NULL)
 		return SoapySDRDevice_lastError();
 #endif
 
-	SoapySDRDevice_activateStream(pc->device, pc->stream, 0, 0, 0);	// flags, timeout, numElems (burst control)
+	// Driver buffers are in the native format, so we can only receive in place when that's what we asked for:
+	pc->queue_samples = driver_queue_samples(pc);
+	pc->direct_buffers = 0;
+	if (!pc->no_direct_access && count == 1 && strcmp(pc->native_format, pc->stream_format->name) == 0)
+		pc->direct_buffers = SoapySDRDevice_getNumDirectAccessBuffers(pc->device, pc->stream);
+	if (pc->verbose)
+	{
+		if (pc->direct_buffers)
+			fprintf(pc->verbose, "Receiving in place from %zu driver buffer%s\n", pc->direct_buffers, s_if_plural(pc->direct_buffers));
+		else
+			fprintf(pc->verbose, "Receiving using readStream\n");
+	}
+
+	if (count > 1)
+	{		// Commands and bursts are for the whole device, but each channel retunes when it's ready
+		if (pc->burst_mode)
+			fprintf(stderr, "Channels retune independently, so streaming continuously instead of in bursts\n");
+		pc->burst_mode = false;
+		pc->timed_commands = false;
+	}
+
+	if (pc->burst_mode && pc->pipelined)
+	{
+		fprintf(stderr, "Burst mode leaves nothing to process during a retune, not pipelining\n");
+		pc->pipelined = false;
+	}
+
+	// In burst mode, each retune activates the stream for one dwell
+	if (!pc->burst_mode)
+		SoapySDRDevice_activateStream(pc->device, pc->stream, 0, 0, 0);	// flags, timeout, numElems (burst control)
 	// REVISIT: direct dsampling
 	// REVISIT: offset tuning
 	return 0;
@@ -620,13 +4589,51 @@ const char* setup_stream(ProgramConfiguration* pc)
 
 void finalise_configuration(ProgramConfiguration* pc)
 {
+	if (pc->receivers)
+		finalise_receivers(pc);
+	stop_acquisition(pc);
+	free(pc->channel_configs);
+	pc->channel_configs = 0;
+	if (pc->stream_owner)
+	{		// The owner closes the stream and device
+		pc->stream = 0;
+		pc->device = 0;
+	}
+	stop_recorder(pc);
+	stop_trigger(pc);
 	if (pc->stream)
 	{
 		SoapySDRDevice_deactivateStream(pc->device, pc->stream, 0, 0);
 		SoapySDRDevice_closeStream(pc->device, pc->stream);
 		pc->stream = 0;
 	}
-	SoapySDRDevice_unmake(pc->device);
+	if (pc->fftw_plan)
+	{
+		fftwf_destroy_plan(pc->fftw_plan);
+		pc->fftw_plan = 0;
+	}
+	if (pc->fftw_frame_plan)
+	{
+		fftwf_destroy_plan(pc->fftw_frame_plan);
+		pc->fftw_frame_plan = 0;
+	}
+	arena_destroy(&pc->arena);
+	close_recording(&pc->recording);
+	close_synthesiser(&pc->synthesiser);
+	free(pc->sample_rates);
+	pc->sample_rates = 0;
+	free(pc->capability_cache);
+	pc->capability_cache = 0;
+	if (!pc->stream_owner)
+	{		// Shared receivers have none of their own
+		SoapySDRKwargs_clear(&pc->hardware_info);
+		SoapySDRKwargs_clear(&pc->channel_info);
+		if (pc->device)		// Probed or cached, not a replayed or synthesised format name
+			free((void*)pc->native_format);
+		pc->native_format = 0;
+	}
+	if (pc->device)
+		SoapySDRDevice_unmake(pc->device);
 	pc->device = 0;
 }
 
@@ -677,11 +4684,57 @@ ClockTime clock_time()
 	return tv.tv_sec*1000000 + tv.tv_usec;
 }
 
+// Count time from the samples from now on, starting at this time
+void start_stream_clock(ProgramConfiguration* pc, ClockTime base)
+{
+	StreamClock*	clock = &pc->stream_clock;
+
+	clock->counted = true;
+	clock->base = base;
+	clock->samples = 0;
+	clock->sample_rate = pc->sample_rate;
+}
+
+// These samples have been delivered. Sets last_time, as receiving them from a device would
+void advance_stream_clock(ProgramConfiguration* pc, long samples)
+{
+	pc->stream_clock.samples += samples;
+	pc->last_time = stream_time(pc);
+	if (!pc->first_time)
+		pc->first_time = pc->last_time;
+}
+
+// The time of the end of the last sample delivered, or the system time if samples arrive in real time
+ClockTime stream_time(ProgramConfiguration* pc)
+{
+	StreamClock*	clock = &pc->stream_clock;
+
+	if (!clock->counted)
+		return clock_time();
+	return clock->base + (ClockTime)(clock->samples * 1e6 / clock->sample_rate);
+}
+
+// How many more samples until the stream clock reaches this time? At least one, so it always advances
+long samples_until(ProgramConfiguration* pc, ClockTime time)
+{
+	StreamClock*	clock = &pc->stream_clock;
+	long		samples = (long)ceil((double)(time - clock->base) * clock->sample_rate / 1e6) - clock->samples;
+
+	return samples > 0 ? samples : 1;
+}
+
 void default_parameters(ProgramConfiguration* pc)
 {
 	memset(pc, 0, sizeof(*pc));
 	pc->crop_ratio = 0.25;
 	pc->scan_time = 10;
+	pc->ring_blocks = RING_BLOCKS;
+	pc->settle_time = -1;
+	pc->receive_cpu = -1;
+	pc->dsp_cpu = -1;
+	pc->trigger.pre_ms = TRIGGER_PRE_MS;
+	pc->trigger.post_ms = TRIGGER_POST_MS;
+	pc->trigger.prefix = "trigger";
 }
 
 Frequency frequency_from_str(const char* cp)
@@ -711,14 +4764,35 @@ void usage(int exit_code)
 	fprintf(stderr,
 		"Usage: powerscan [ options... ]\n"
 		"\t-v\t\tDisplay detailed information\n"
-		"\t-d device\tSelect an SDR device (\"help\" for a list)\n"
+		"\t-d device\tSelect an SDR device (\"help\" for a list). Repeat to share the scan between devices\n"
+		"\t-f file\t\tReplay a SigMF or raw (.cs8, .cu8, .cs12, .cs16, .cf32) recording instead\n"
+		"\t-w name\t\tRecord received samples to name.sigmf-data and name.sigmf-meta\n"
+		"\t-T dBFS\t\tCapture samples around any FFT bin at or above this level\n"
+		"\t-H pre,post\tMilliseconds to capture before and after a trigger (default 100,100)\n"
+		"\t-O prefix\tWrite triggered captures to prefix-N.sigmf-data (default \"trigger\")\n"
+		"\t-G signals\tSynthesise signals instead, a comma-separated list of:\n"
+		"\t\t\t  tone:freq[:dBFS], chirp:freq:span[:dBFS], burst:freq:duty[:dBFS], noise[:dBFS]\n"
 		"\t-C channel\tSelect an SDR channel\n"
+		"\t-m channels\tStream this many channels from the one selected, taking alternate tunings\n"
 		"\t-s freq\t\tStart frequency\n"
 		"\t-e freq\t\tEnd frequency\n"
 		"\t-r freq\t\tFrequency resolution\n"
 		"\t-R freq\t\tSample rate upper limit\n"
 		"\t-c ratio\tCrop ratio, how much of each tuning band to ignore (0-0.6)\n"
 		"\t-t time\t\tComplete each scan in this many seconds (default 10)\n"
+		"\t-b blocks\tBuffers between receive and DSP threads (default 16, 0 for no thread)\n"
+		"\t-D\t\tDon't receive directly from driver buffers\n"
+		"\t-S usec\t\tTime for the device to settle after retuning (default depends on device)\n"
+		"\t-p\t\tPipeline retunes with processing of the previous tuning\n"
+		"\t-B\t\tReceive one burst per tuning instead of streaming continuously\n"
+		"\t-M\t\tLock buffers in memory, using huge pages if available\n"
+		"\t-P cpu[,cpu]\tPin the receive path, and the FFT path, to these CPUs\n"
+		"\t-F priority\tRun the receive path with SCHED_FIFO at this priority\n"
+		"\t-N frames\tTransform this many FFT frames together (default enough for 16384 samples)\n"
+		"\t-o percent\tOverlap each FFT frame with the next by this much, e.g. 50 or 75 (default 0)\n"
+		"\t-k kernels\tUse these DSP kernels (plain, avx2, avx512 or neon) instead of the best the CPU has\n"
+		"\t-K\t\tProbe the device's capabilities again, instead of using the cache\n"
+		"\t-L socket\tKeep the device open, and serve scan requests on this Unix socket\n"
 //		"\t-a name\t\tSelect antenna\n"
 		"\t-g gain\t\tReceive gainn"
 		"\t-1\t\tMake a single scan\n"
@@ -733,7 +4807,7 @@ bool gather_parameters(ProgramConfiguration* pc, int argc, char **argv)
 	int	opt;
 
 	default_parameters(pc);
-	while ((opt = getopt(argc, argv, "vd:C:a:g:s:e:r:c:1l:t:h?")) != -1) {
+	while ((opt = getopt(argc, argv, "vd:f:G:w:T:H:O:C:m:a:g:s:e:r:R:c:1l:t:b:DS:pBMP:F:k:KL:N:o:h?")) != -1) {
 		switch (opt) {
 		case 'v':		// verbose output
 			pc->verbose = stderr;
@@ -746,12 +4820,53 @@ bool gather_parameters(ProgramConfiguration* pc, int argc, char **argv)
 				list_sdr_devices(stdout);
 				return false;
 			}
+			pc->sdr_names = (const char**)realloc(pc->sdr_names, sizeof(const char*) * (pc->sdr_name_count+1));
+			pc->sdr_names[pc->sdr_name_count++] = optarg;
+			break;
+
+		case 'f':		// Replay a recording
+			pc->replay_path = optarg;
+			break;
+
+		case 'w':		// Record received samples
+			pc->record_base = optarg;
+			break;
+
+		case 'T':		// Trigger level
+			pc->triggered = true;
+			pc->trigger.level = atof(optarg);
+			break;
+
+		case 'H':		// Trigger windows
+		{
+			char*	endptr;
+			pc->trigger.pre_ms = strtol(optarg, &endptr, 10);
+			if (*endptr == ',')
+				pc->trigger.post_ms = atol(endptr+1);
+			break;
+		}
+
+		case 'O':
+			pc->trigger.prefix = optarg;
+			break;
+
+		case 'G':		// Synthesise signals
+			pc->synthesise_spec = optarg;
 			break;
 
 		case 'C':
 			pc->sdr_channel = atol(optarg);
 			break;
 
+		case 'm':		// Stream several channels
+			pc->stream_channels = atol(optarg);
+			if (pc->stream_channels > MAX_STREAM_CHANNELS)
+			{
+				fprintf(stderr, "At most %d channels can be streamed together\n", MAX_STREAM_CHANNELS);
+				pc->stream_channels = MAX_STREAM_CHANNELS;
+			}
+			break;
+
 #if 0
 		case 'a':		// Select an antenna system
 			pc->antenna = optarg;
@@ -786,6 +4901,68 @@ bool gather_parameters(ProgramConfiguration* pc, int argc, char **argv)
 			pc->crop_ratio = atof(optarg);
 			break;
 
+		case 'b':
+			pc->ring_blocks = atol(optarg);
+			break;
+
+		case 'D':
+			pc->no_direct_access = true;
+			break;
+
+		case 'S':
+			pc->settle_time = atol(optarg);
+			break;
+
+		case 'p':
+			pc->pipelined = true;
+			break;
+
+		case 'B':
+			pc->burst_mode = true;
+			break;
+
+		case 'M':
+			pc->lock_memory = true;
+			break;
+
+		case 'P':
+		{
+			char*	endptr;
+			pc->receive_cpu = strtol(optarg, &endptr, 10);
+			if (*endptr == ',')
+				pc->dsp_cpu = atol(endptr+1);
+			break;
+		}
+
+		case 'F':
+			pc->receive_priority = atol(optarg);
+			break;
+
+		case 'N':		// FFT batch size
+			pc->requested_batch = atol(optarg);
+			break;
+
+		case 'o':		// Overlap FFT frames
+			pc->overlap_percent = atol(optarg);
+			if (pc->overlap_percent < 0 || pc->overlap_percent > MAX_OVERLAP)
+			{
+				fprintf(stderr, "Frames can overlap by 0 to %d%%\n", MAX_OVERLAP);
+				return false;
+			}
+			break;
+
+		case 'k':		// Choose DSP kernels
+			pc->kernel_name = optarg;
+			break;
+
+		case 'K':
+			pc->probe_again = true;
+			break;
+
+		case 'L':		// Serve scan requests
+			pc->socket_path = optarg;
+			break;
+
 		case '1':		// Make a single scan
 			pc->repetition_limit = 1;
 			break;
@@ -0,0 +1,605 @@
+/*
+ * powerscan_sim: A SoapySDR module that simulates a receiver, so that device setup,
+ * streaming, and retune handling can be exercised and timed without hardware.
+ *
+ * Select it with "-d driver=powerscan_sim", adding any of these device arguments:
+ *	rates=1e6/2.4e6/10e6	Sample rates to offer, separated by '/'
+ *	format=CS16		Native stream format (CS8, CU8, CS12, CS16 or CF32)
+ *	mtu=16384		Samples delivered by each read
+ *	buffers=16		Direct access buffers (0 = readStream only)
+ *	retune_us=2000		How long after setFrequency() before samples are at the new frequency
+ *	timestamps=1		Report hardware time, stamp each read, and honour setCommandTime()
+ *	overflow=0		Inject an overflow every this many reads
+ *	realtime=1		Deliver samples at the sample rate (0 = as fast as they are read)
+ *	tones=100.3e6/101e6	Carriers at these frequencies, at -20dBFS over -60dBFS noise
+ *	channels=1		Number of receive channels
+ *
+ * When not running in real time, the hardware time follows the samples delivered,
+ * so a run is repeatable.
+ */
+#include	<SoapySDR/Device.hpp>
+#include	<SoapySDR/Registry.hpp>
+#include	<SoapySDR/Formats.hpp>
+#include	<SoapySDR/Time.hpp>
+
+#include	<algorithm>
+#include	<chrono>
+#include	<cmath>
+#include	<complex>
+#include	<condition_variable>
+#include	<cstdint>
+#include	<cstring>
+#include	<mutex>
+#include	<random>
+#include	<sstream>
+#include	<stdexcept>
+#include	<thread>
+
+#define	SIM_DRIVER	"powerscan_sim"
+#define	SIM_RATES	"1e6/2e6/2.4e6/8e6/10e6"
+#define	SIM_MTU		16384
+#define	SIM_BUFFERS	16
+#define	SIM_RETUNE_US	2000
+#define	SIM_TONE_LEVEL	0.1f			// -20dBFS
+#define	SIM_NOISE_LEVEL	0.0007f			// Per component, -60dBFS in total
+
+typedef std::complex<float>	Sample;
+
+/*
+ * Each channel tunes separately. A retune takes effect at a device time,
+ * until which the samples are still at the old frequency.
+ */
+struct SimChannel
+{
+	double		frequency;		// What the samples are at now
+	double		pending_frequency;	// What they will be at after pending_time
+	long long	pending_time;		// Device time (ns) of the change, or -1 if none is pending
+	double		gain;
+	std::vector<Sample>	phasors;	// One per tone
+};
+
+struct SimStream
+{
+	std::vector<size_t>	channels;
+	std::string	format;
+	size_t		bytes;			// Per sample, in this format
+};
+
+class PowerscanSim : public SoapySDR::Device
+{
+public:
+	PowerscanSim(const SoapySDR::Kwargs& args);
+	~PowerscanSim();
+
+	/* Identification */
+	std::string	getDriverKey(void) const { return SIM_DRIVER; }
+	std::string	getHardwareKey(void) const { return SIM_DRIVER; }
+	SoapySDR::Kwargs getHardwareInfo(void) const;
+	size_t		getNumChannels(const int direction) const { return direction == SOAPY_SDR_RX ? channels.size() : 0; }
+
+	/* Streams */
+	std::vector<std::string> getStreamFormats(const int direction, const size_t channel) const;
+	std::string	getNativeStreamFormat(const int direction, const size_t channel, double& fullScale) const;
+	SoapySDR::Stream* setupStream(const int direction, const std::string& format, const std::vector<size_t>& channels, const SoapySDR::Kwargs& args);
+	void		closeStream(SoapySDR::Stream* stream);
+	size_t		getStreamMTU(SoapySDR::Stream* stream) const { return mtu; }
+	int		activateStream(SoapySDR::Stream* stream, const int flags, const long long timeNs, const size_t numElems);
+	int		deactivateStream(SoapySDR::Stream* stream, const int flags, const long long timeNs);
+	int		readStream(SoapySDR::Stream* stream, void* const* buffs, const size_t numElems, int& flags, long long& timeNs, const long timeoutUs);
+	size_t		getNumDirectAccessBuffers(SoapySDR::Stream* stream) { return buffers.size(); }
+	int		getDirectAccessBufferAddrs(SoapySDR::Stream* stream, const size_t handle, void** buffs);
+	int		acquireReadBuffer(SoapySDR::Stream* stream, size_t& handle, const void** buffs, int& flags, long long& timeNs, const long timeoutUs);
+	void		releaseReadBuffer(SoapySDR::Stream* stream, const size_t handle);
+
+	/* Tuning */
+	void		setFrequency(const int direction, const size_t channel, const double frequency, const SoapySDR::Kwargs& args);
+	double		getFrequency(const int direction, const size_t channel) const;
+	SoapySDR::RangeList getFrequencyRange(const int direction, const size_t channel) const;
+	void		setSampleRate(const int direction, const size_t channel, const double rate);
+	double		getSampleRate(const int direction, const size_t channel) const { return rate; }
+	std::vector<double> listSampleRates(const int direction, const size_t channel) const { return rates; }
+	void		setGain(const int direction, const size_t channel, const double value);
+	SoapySDR::Range	getGainRange(const int direction, const size_t channel) const { return SoapySDR::Range(0, 60); }
+	std::vector<std::string> listAntennas(const int direction, const size_t channel) const { return std::vector<std::string>(1, "RX"); }
+
+	/* Time */
+	bool		hasHardwareTime(const std::string& what) const { return timestamps; }
+	long long	getHardwareTime(const std::string& what) const;
+	void		setHardwareTime(const long long timeNs, const std::string& what);
+	void		setCommandTime(const long long timeNs, const std::string& what);
+
+private:
+	long long	device_time() const;
+	int		read(SimStream* stream, std::unique_lock<std::mutex>& lock, char* const* out, size_t samples, int& flags, long long& timeNs, long timeoutUs);
+	void		generate(size_t channel, Sample* out, size_t samples);
+	void		convert(const Sample* in, const std::string& format, char* out, size_t samples);
+	long long	samples_to_ns(long long samples) const { return SoapySDR::ticksToTimeNs(samples, rate); }
+
+	/* Configuration, from the device arguments */
+	std::vector<double>	rates;
+	std::string	format;			// Native format
+	double		full_scale;
+	size_t		mtu;
+	long long	retune_ns;
+	bool		timestamps;
+	int		overflow_every;
+	bool		realtime;
+	std::vector<double>	tones;
+
+	/* State */
+	mutable std::mutex	mutex;
+	std::condition_variable	activated;	// Wakes a read waiting for the stream to start
+	std::chrono::steady_clock::time_point	epoch;	// Device time zero, when realtime
+	long long	time_offset;		// Added to the device time, by setHardwareTime()
+	long long	command_time;		// When to apply later commands (0 = now)
+	double		rate;
+	std::vector<SimChannel>	channels;
+	bool		active;
+	bool		burst;			// Activated for a fixed number of samples
+	size_t		burst_remaining;
+	long long	next_time;		// Device time (ns) of the next sample to deliver
+	long long	next_sample;		// Samples since activation, for the phase of each tone
+	int		reads;
+	std::vector<std::vector<char> >	buffers;	// Direct access buffers, one channel each
+	std::vector<bool>	held;		// Acquired and not yet released
+	size_t		next_buffer;
+	std::vector<Sample>	scratch;
+	std::minstd_rand	random;
+	std::normal_distribution<float>	noise;
+};
+
+static std::vector<std::string> split(const std::string& s, char separator)
+{
+	std::vector<std::string>	fields;
+	std::stringstream	ss(s);
+	std::string		field;
+
+	while (std::getline(ss, field, separator))
+		if (!field.empty())
+			fields.push_back(field);
+	return fields;
+}
+
+static std::string arg(const SoapySDR::Kwargs& args, const std::string& key, const std::string& def)
+{
+	SoapySDR::Kwargs::const_iterator	it = args.find(key);
+	return it == args.end() ? def : it->second;
+}
+
+static size_t format_bytes(const std::string& format)
+{
+	if (format == SOAPY_SDR_CS12)
+		return 3;
+	return SoapySDR::formatToSize(format);
+}
+
+PowerscanSim::PowerscanSim(const SoapySDR::Kwargs& args)
+	: time_offset(0), command_time(0), active(false), burst(false), burst_remaining(0),
+	  next_time(0), next_sample(0), reads(0), next_buffer(0), noise(0, SIM_NOISE_LEVEL)
+{
+	std::vector<std::string>	names = split(arg(args, "rates", SIM_RATES), '/');
+
+	for (size_t i = 0; i < names.size(); i++)
+		rates.push_back(std::stod(names[i]));
+	if (rates.empty())
+		throw std::runtime_error(SIM_DRIVER ": no sample rates");
+	std::sort(rates.begin(), rates.end());
+	rate = rates.back();
+
+	format = arg(args, "format", SOAPY_SDR_CS16);
+	if (format == SOAPY_SDR_CS8 || format == SOAPY_SDR_CU8)
+		full_scale = 128;
+	else if (format == SOAPY_SDR_CS12)
+		full_scale = 2048;
+	else if (format == SOAPY_SDR_CS16)
+		full_scale = 32768;
+	else if (format == SOAPY_SDR_CF32)
+		full_scale = 1;
+	else
+		throw std::runtime_error(SIM_DRIVER ": unsupported format " + format);
+
+	mtu = std::stoul(arg(args, "mtu", std::to_string(SIM_MTU)));
+	retune_ns = std::stoll(arg(args, "retune_us", std::to_string(SIM_RETUNE_US))) * 1000;
+	timestamps = std::stoi(arg(args, "timestamps", "1")) != 0;
+	overflow_every = std::stoi(arg(args, "overflow", "0"));
+	realtime = std::stoi(arg(args, "realtime", "1")) != 0;
+
+	names = split(arg(args, "tones", ""), '/');
+	for (size_t i = 0; i < names.size(); i++)
+		tones.push_back(std::stod(names[i]));
+
+	channels.resize(std::stoul(arg(args, "channels", "1")));
+	for (size_t c = 0; c < channels.size(); c++)
+	{
+		channels[c].frequency = channels[c].pending_frequency = 100e6;
+		channels[c].pending_time = -1;
+		channels[c].gain = 0;
+		channels[c].phasors.assign(tones.size(), Sample(1, 0));
+	}
+
+	size_t	buffer_count = std::stoul(arg(args, "buffers", std::to_string(SIM_BUFFERS)));
+	buffers.assign(buffer_count, std::vector<char>(mtu * format_bytes(format)));
+	held.assign(buffer_count, false);
+	scratch.resize(mtu);
+	epoch = std::chrono::steady_clock::now();
+}
+
+PowerscanSim::~PowerscanSim()
+{
+}
+
+SoapySDR::Kwargs PowerscanSim::getHardwareInfo(void) const
+{
+	SoapySDR::Kwargs	info;
+
+	info["serial"] = "sim0";
+	info["version"] = "1.0";
+	return info;
+}
+
+std::vector<std::string> PowerscanSim::getStreamFormats(const int direction, const size_t channel) const
+{
+	std::vector<std::string>	formats;
+
+	formats.push_back(format);
+	if (format != SOAPY_SDR_CS16)
+		formats.push_back(SOAPY_SDR_CS16);
+	if (format != SOAPY_SDR_CF32)
+		formats.push_back(SOAPY_SDR_CF32);
+	return formats;
+}
+
+std::string PowerscanSim::getNativeStreamFormat(const int direction, const size_t channel, double& fullScale) const
+{
+	fullScale = full_scale;
+	return format;
+}
+
+SoapySDR::Stream* PowerscanSim::setupStream(const int direction, const std::string& stream_format, const std::vector<size_t>& stream_channels, const SoapySDR::Kwargs& args)
+{
+	if (direction != SOAPY_SDR_RX)
+		throw std::runtime_error(SIM_DRIVER ": receive only");
+	if (stream_format != format && stream_format != SOAPY_SDR_CS16 && stream_format != SOAPY_SDR_CF32)
+		throw std::runtime_error(SIM_DRIVER ": unsupported stream format " + stream_format);
+
+	SimStream*	stream = new SimStream;
+
+	stream->channels = stream_channels.empty() ? std::vector<size_t>(1, 0) : stream_channels;
+	for (size_t i = 0; i < stream->channels.size(); i++)
+		if (stream->channels[i] >= channels.size())
+		{
+			delete stream;
+			throw std::runtime_error(SIM_DRIVER ": no such channel");
+		}
+	stream->format = stream_format;
+	stream->bytes = format_bytes(stream_format);
+	return reinterpret_cast<SoapySDR::Stream*>(stream);
+}
+
+void PowerscanSim::closeStream(SoapySDR::Stream* stream)
+{
+	delete reinterpret_cast<SimStream*>(stream);
+}
+
+int PowerscanSim::activateStream(SoapySDR::Stream* stream, const int flags, const long long timeNs, const size_t numElems)
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+	long long	now = device_time();
+
+	if (!active || burst)
+		next_time = (flags & SOAPY_SDR_HAS_TIME) && timeNs > now ? timeNs : now;
+	active = true;
+	burst = (flags & SOAPY_SDR_END_BURST) && numElems > 0;
+	burst_remaining = numElems;
+	activated.notify_all();
+	return 0;
+}
+
+int PowerscanSim::deactivateStream(SoapySDR::Stream* stream, const int flags, const long long timeNs)
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+
+	active = false;
+	return 0;
+}
+
+int PowerscanSim::readStream(SoapySDR::Stream* handle, void* const* buffs, const size_t numElems, int& flags, long long& timeNs, const long timeoutUs)
+{
+	std::unique_lock<std::mutex>	lock(mutex);
+
+	return read(reinterpret_cast<SimStream*>(handle), lock, reinterpret_cast<char* const*>(buffs), std::min(numElems, mtu), flags, timeNs, timeoutUs);
+}
+
+int PowerscanSim::getDirectAccessBufferAddrs(SoapySDR::Stream* stream, const size_t handle, void** buffs)
+{
+	if (handle >= buffers.size())
+		return SOAPY_SDR_NOT_SUPPORTED;
+	buffs[0] = buffers[handle].data();
+	return 0;
+}
+
+// Buffers are filled on demand, in the native format, for the first channel of the stream
+int PowerscanSim::acquireReadBuffer(SoapySDR::Stream* handle, size_t& buffer, const void** buffs, int& flags, long long& timeNs, const long timeoutUs)
+{
+	std::unique_lock<std::mutex>	lock(mutex);
+	SimStream*	stream = reinterpret_cast<SimStream*>(handle);
+	SimStream	native = *stream;
+	int		result;
+
+	if (buffers.empty() || stream->format != format)
+		return SOAPY_SDR_NOT_SUPPORTED;
+	if (held[next_buffer])
+		return SOAPY_SDR_OVERFLOW;	// The application isn't releasing buffers, so the driver would drop samples
+
+	char*		out = buffers[next_buffer].data();
+
+	native.channels.resize(1);
+	if ((result = read(&native, lock, &out, mtu, flags, timeNs, timeoutUs)) < 0)
+		return result;
+	buffer = next_buffer;
+	buffs[0] = out;
+	held[buffer] = true;
+	next_buffer = (next_buffer + 1) % buffers.size();
+	return result;
+}
+
+void PowerscanSim::releaseReadBuffer(SoapySDR::Stream* stream, const size_t handle)
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+
+	if (handle < held.size())
+		held[handle] = false;
+}
+
+/*
+ * Deliver the next samples, waiting for them to be "received" when running in real time.
+ * Samples older than the driver's buffers would hold are lost, and reported as an overflow.
+ */
+int PowerscanSim::read(SimStream* stream, std::unique_lock<std::mutex>& lock, char* const* out, size_t samples, int& flags, long long& timeNs, long timeoutUs)
+{
+	std::chrono::steady_clock::time_point	deadline = std::chrono::steady_clock::now() + std::chrono::microseconds(timeoutUs);
+
+	flags = 0;
+	while (!active || (burst && burst_remaining == 0))
+		if (activated.wait_until(lock, deadline) == std::cv_status::timeout)
+			return SOAPY_SDR_TIMEOUT;
+
+	if (overflow_every > 0 && ++reads % overflow_every == 0)
+	{
+		next_time += samples_to_ns(mtu);
+		next_sample += mtu;
+		return SOAPY_SDR_OVERFLOW;
+	}
+
+	if (burst && samples > burst_remaining)
+		samples = burst_remaining;
+
+	if (realtime)
+	{
+		long long	capacity = samples_to_ns(mtu * std::max<size_t>(buffers.size(), 2));
+		long long	now = device_time();
+
+		if (now - next_time > capacity)
+		{		// Drop what the driver's buffers couldn't hold
+			long long	lost = SoapySDR::timeNsToTicks(now - next_time, rate);
+			next_time += samples_to_ns(lost);
+			next_sample += lost;
+			return SOAPY_SDR_OVERFLOW;
+		}
+
+		long long	ready = next_time + samples_to_ns(samples);
+		while ((now = device_time()) < ready)
+		{
+			std::chrono::steady_clock::time_point	wake = epoch + std::chrono::nanoseconds(ready - time_offset);
+			if (wake > deadline)
+				return SOAPY_SDR_TIMEOUT;
+			lock.unlock();
+			std::this_thread::sleep_until(wake);
+			lock.lock();
+			if (!active)
+				return SOAPY_SDR_TIMEOUT;
+		}
+	}
+
+	// Apply any retune that has taken effect by the end of these samples, at the sample where it happened:
+	for (size_t i = 0; i < stream->channels.size(); i++)
+	{
+		SimChannel&	channel = channels[stream->channels[i]];
+		size_t		before = samples;
+
+		if (channel.pending_time >= 0 && channel.pending_time < next_time + samples_to_ns(samples))
+			before = channel.pending_time <= next_time ? 0 : (size_t)SoapySDR::timeNsToTicks(channel.pending_time - next_time, rate);
+		generate(stream->channels[i], scratch.data(), before);
+		if (before < samples)
+		{
+			channel.frequency = channel.pending_frequency;
+			channel.pending_time = -1;
+			generate(stream->channels[i], scratch.data() + before, samples - before);
+		}
+		convert(scratch.data(), stream->format, out[i], samples);
+	}
+
+	if (timestamps)
+		flags |= SOAPY_SDR_HAS_TIME;
+	timeNs = next_time;
+	next_time += samples_to_ns(samples);
+	next_sample += samples;
+	if (burst && (burst_remaining -= samples) == 0)
+		flags |= SOAPY_SDR_END_BURST;
+	return (int)samples;
+}
+
+// Tones that fall within the band, over Gaussian noise, scaled by the gain
+void PowerscanSim::generate(size_t c, Sample* out, size_t samples)
+{
+	SimChannel&	channel = channels[c];
+	float		gain = std::pow(10.0f, (float)channel.gain / 20) / std::pow(10.0f, 3.0f);	// 60dB of gain is unity
+
+	for (size_t s = 0; s < samples; s++)
+		out[s] = Sample(noise(random), noise(random));
+
+	for (size_t t = 0; t < tones.size(); t++)
+	{
+		double	offset = tones[t] - channel.frequency;
+		Sample	phasor = channel.phasors[t];
+		Sample	step = std::polar(1.0f, (float)(2 * M_PI * offset / rate));
+
+		if (std::fabs(offset) >= rate/2)
+			continue;
+		for (size_t s = 0; s < samples; s++)
+		{
+			out[s] += phasor * SIM_TONE_LEVEL;
+			phasor *= step;
+		}
+		channel.phasors[t] = phasor / std::abs(phasor);
+	}
+
+	if (channel.gain > 0)
+		for (size_t s = 0; s < samples; s++)
+			out[s] *= gain;
+}
+
+void PowerscanSim::convert(const Sample* in, const std::string& stream_format, char* out, size_t samples)
+{
+	if (stream_format == SOAPY_SDR_CF32)
+		memcpy(out, in, samples * sizeof(Sample));
+	else if (stream_format == SOAPY_SDR_CS16)
+	{
+		int16_t*	o = reinterpret_cast<int16_t*>(out);
+		for (size_t s = 0; s < samples; s++)
+		{
+			*o++ = (int16_t)std::max(-32768.0f, std::min(32767.0f, in[s].real() * 32768));
+			*o++ = (int16_t)std::max(-32768.0f, std::min(32767.0f, in[s].imag() * 32768));
+		}
+	}
+	else if (stream_format == SOAPY_SDR_CS12)
+	{
+		uint8_t*	o = reinterpret_cast<uint8_t*>(out);
+		for (size_t s = 0; s < samples; s++, o += 3)
+		{		// I in the low 12 bits
+			int	i = (int)std::max(-2048.0f, std::min(2047.0f, in[s].real() * 2048));
+			int	q = (int)std::max(-2048.0f, std::min(2047.0f, in[s].imag() * 2048));
+			o[0] = (uint8_t)i;
+			o[1] = (uint8_t)(((i >> 8) & 0x0F) | (q << 4));
+			o[2] = (uint8_t)(q >> 4);
+		}
+	}
+	else
+	{
+		int8_t*		o = reinterpret_cast<int8_t*>(out);
+		int		bias = stream_format == SOAPY_SDR_CU8 ? 128 : 0;
+		for (size_t s = 0; s < samples; s++)
+		{
+			*o++ = (int8_t)((int)std::max(-128.0f, std::min(127.0f, in[s].real() * 128)) + bias);
+			*o++ = (int8_t)((int)std::max(-128.0f, std::min(127.0f, in[s].imag() * 128)) + bias);
+		}
+	}
+}
+
+// A retune takes effect after the retune latency, counted from the command time if one is set
+void PowerscanSim::setFrequency(const int direction, const size_t c, const double frequency, const SoapySDR::Kwargs& args)
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+	long long	now = device_time();
+
+	if (c >= channels.size())
+		throw std::runtime_error(SIM_DRIVER ": no such channel");
+	if (channels[c].pending_time >= 0)
+		channels[c].frequency = channels[c].pending_frequency;
+	channels[c].pending_frequency = frequency;
+	channels[c].pending_time = (timestamps && command_time > now ? command_time : now) + retune_ns;
+	if (!active)
+	{
+		channels[c].frequency = frequency;
+		channels[c].pending_time = -1;
+	}
+}
+
+double PowerscanSim::getFrequency(const int direction, const size_t c) const
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+
+	return c < channels.size() ? channels[c].pending_frequency : 0;
+}
+
+SoapySDR::RangeList PowerscanSim::getFrequencyRange(const int direction, const size_t channel) const
+{
+	return SoapySDR::RangeList(1, SoapySDR::Range(1e6, 6e9));
+}
+
+// Like most hardware, use the nearest rate we have
+void PowerscanSim::setSampleRate(const int direction, const size_t channel, const double requested)
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+
+	rate = rates[0];
+	for (size_t i = 1; i < rates.size(); i++)
+		if (std::fabs(rates[i] - requested) < std::fabs(rate - requested))
+			rate = rates[i];
+}
+
+void PowerscanSim::setGain(const int direction, const size_t c, const double value)
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+
+	if (c < channels.size())
+		channels[c].gain = value;
+}
+
+// Device time runs in real time, or follows the samples delivered
+long long PowerscanSim::device_time() const
+{
+	if (!realtime)
+		return next_time;
+	return time_offset + std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() - epoch).count();
+}
+
+long long PowerscanSim::getHardwareTime(const std::string& what) const
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+
+	return device_time();
+}
+
+void PowerscanSim::setHardwareTime(const long long timeNs, const std::string& what)
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+
+	if (realtime)
+		time_offset += timeNs - device_time();
+	else
+		next_time = timeNs;
+}
+
+void PowerscanSim::setCommandTime(const long long timeNs, const std::string& what)
+{
+	std::lock_guard<std::mutex>	lock(mutex);
+
+	if (!timestamps)
+		throw std::runtime_error(SIM_DRIVER ": no hardware time");
+	command_time = timeNs;
+}
+
+/*
+ * Registration. The simulator is only found when asked for by name, so it never stands in for real hardware.
+ */
+static SoapySDR::KwargsList find_sim(const SoapySDR::Kwargs& args)
+{
+	SoapySDR::KwargsList	found;
+
+	if (arg(args, "driver", "") == SIM_DRIVER)
+	{
+		SoapySDR::Kwargs	device = args;
+		device["label"] = "powerscan simulated receiver";
+		device["serial"] = "sim0";
+		found.push_back(device);
+	}
+	return found;
+}
+
+static SoapySDR::Device* make_sim(const SoapySDR::Kwargs& args)
+{
+	return new PowerscanSim(args);
+}
+
+static SoapySDR::Registry	register_sim(SIM_DRIVER, &find_sim, &make_sim, SOAPY_SDR_ABI_VERSION);
@@ -0,0 +1,29 @@
+#
+# Make a one-shot scan of the powerscan_sim module with one tone, and check the tone lands in its bucket.
+# Run by CTest as: cmake -DPOWERSCAN=path -DTONE=hz -P sim_scan.cmake
+#
+execute_process(
+    COMMAND ${POWERSCAN} -v -K -1 -b 0 -t 1 -R 2M -s 100M -e 101M
+        -d driver=powerscan_sim,realtime=0,tones=${TONE}
+    RESULT_VARIABLE result
+    OUTPUT_VARIABLE output
+    ERROR_VARIABLE output
+)
+if (NOT result EQUAL 0)
+    message(FATAL_ERROR "powerscan failed (${result}):\n${output}")
+endif ()
+
+string(REGEX MATCH "Frequency Resolution[ \t]*([0-9]+)" match "${output}")
+set(resolution "${CMAKE_MATCH_1}")
+string(REGEX MATCH "Strongest bucket [0-9]+ at ([0-9]+)Hz" match "${output}")
+set(peak "${CMAKE_MATCH_1}")
+if (NOT resolution OR NOT peak)
+    message(FATAL_ERROR "No strongest bucket reported:\n${output}")
+endif ()
+
+# The tone's bucket starts at or below it, within one resolution step
+math(EXPR offset "${TONE} - ${peak}")
+if (offset LESS 0 OR NOT offset LESS resolution)
+    message(FATAL_ERROR "Tone at ${TONE}Hz peaked in the bucket at ${peak}Hz, not the one within ${resolution}Hz below it")
+endif ()
+message(STATUS "Tone at ${TONE}Hz peaked in the bucket at ${peak}Hz")